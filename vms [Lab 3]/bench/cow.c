@@ -0,0 +1,87 @@
+#include "vms.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/* First writes to copy-on-write pages in a child, each breaking COW */
+#define PAGES (1 << 13)
+#define ROUNDS 10
+
+static uint8_t* const base = (uint8_t*) 0x40000000;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fork with `fork`, write every page once in the child and tear it down.
+   Returns the seconds spent writing and adds the handler runs and TLB
+   misses to `faults` and `misses`. */
+static double time_writes(void* (*fork)(), uint64_t* faults, uint64_t* misses) {
+    void* parent = vms_get_root_page_table();
+    void* child = fork();
+    if (child == NULL) {
+        return -1;
+    }
+    vms_set_root_page_table(child);
+    vms_swap_reset_stats();
+    vms_tlb_reset_stats();
+    double start = now();
+    for (int page = 0; page < PAGES; ++page) {
+        vms_write(base + (size_t) page * PAGE_SIZE, -page);
+    }
+    double seconds = now() - start;
+
+    struct vms_swap_stats swap;
+    struct vms_tlb_stats tlb;
+    vms_swap_get_stats(&swap);
+    vms_tlb_get_stats(&tlb);
+    *faults += swap.faults;
+    *misses += tlb.misses;
+    vms_set_root_page_table(parent);
+    vms_destroy_address_space(child);
+    return seconds;
+}
+
+static int run(const char* name, void* (*fork)()) {
+    double total = 0;
+    uint64_t faults = 0;
+    uint64_t misses = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        double seconds = time_writes(fork, &faults, &misses);
+        if (seconds < 0) {
+            return 1;
+        }
+        total += seconds;
+    }
+    double writes = (double) PAGES * ROUNDS;
+    printf("%-8s %12.1f %12.2f %12.2f\n",
+           name, total / writes * 1e9, faults / writes, misses / writes);
+    return 0;
+}
+
+int main() {
+    /* Room for the parent, a child's copies and both sides' tables */
+    if (vms_init_pool(2 * PAGES + 2 * (PAGES / 512) + 16) != 0) {
+        return 1;
+    }
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    if (vms_map_range(base, (size_t) PAGES * PAGE_SIZE,
+                      VMS_PROT_READ | VMS_PROT_WRITE,
+                      VMS_MAP_POPULATE) != 0) {
+        return 1;
+    }
+    for (int page = 0; page < PAGES; ++page) {
+        vms_write(base + (size_t) page * PAGE_SIZE, page);
+    }
+
+    printf("%-8s %12s %12s %12s\n", "fork", "ns/write", "faults", "walks");
+    if (run("cow", vms_fork_copy_on_write) != 0
+        || run("shared", vms_fork_copy_on_write_shared) != 0) {
+        return 1;
+    }
+    vms_destroy_address_space(l2);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "vms.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUNDS 5
+
+static uint8_t* const base = (uint8_t*) 0x40000000;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Average time to fork the current address space and tear the child down
+   again, using `threads` (1 is the serial vms_fork_copy, 0 is
+   vms_fork_copy_on_write) */
+static double time_fork(int threads) {
+    double total = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        double start = now();
+        void* child = threads == 0 ? vms_fork_copy_on_write()
+                      : threads == 1 ? vms_fork_copy()
+                      : vms_fork_copy_parallel(threads);
+        total += now() - start;
+        if (child == NULL) {
+            return -1;
+        }
+        vms_destroy_address_space(child);
+    }
+    return total / ROUNDS;
+}
+
+int main() {
+    static const int mapped_pages[] = {1 << 10, 1 << 13, 1 << 16};
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    printf("%10s %8s %12s %8s\n", "pages", "threads", "ms", "speedup");
+    for (size_t i = 0; i < sizeof(mapped_pages) / sizeof(int); ++i) {
+        int pages = mapped_pages[i];
+        /* Room for the parent, the child and their tables */
+        if (vms_init_pool(2 * pages + 2 * (pages / 512) + 16) != 0) {
+            return 1;
+        }
+        void* l2 = vms_new_page();
+        vms_set_root_page_table(l2);
+        if (vms_map_range(base, (size_t) pages * PAGE_SIZE,
+                          VMS_PROT_READ | VMS_PROT_WRITE,
+                          VMS_MAP_POPULATE) != 0) {
+            return 1;
+        }
+        for (int page = 0; page < pages; ++page) {
+            vms_write(base + (size_t) page * PAGE_SIZE, page);
+        }
+
+        /* Touch the child's half of the pool once so no run pays for it */
+        void* warm = vms_fork_copy();
+        if (warm == NULL) {
+            return 1;
+        }
+        vms_destroy_address_space(warm);
+
+        double serial = time_fork(1);
+        printf("%10d %8d %12.3f %8.2f\n", pages, 1, serial * 1e3, 1.0);
+        for (int threads = 2; threads <= 2 * cores && threads <= 16; threads *= 2) {
+            double parallel = time_fork(threads);
+            if (serial < 0 || parallel < 0) {
+                return 1;
+            }
+            printf("%10d %8d %12.3f %8.2f\n",
+                   pages, threads, parallel * 1e3, serial / parallel);
+        }
+        double cow = time_fork(0);
+        if (cow < 0) {
+            return 1;
+        }
+        printf("%10d %8s %12.3f %8.2f\n", pages, "cow", cow * 1e3, serial / cow);
+        vms_destroy_address_space(l2);
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "vms.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAPPED_PAGES 512
+#define ROUNDS 20
+
+static uint8_t* const base = (uint8_t*) 0x40000000;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void map_region() {
+    void* l2 = vms_new_page();
+    void* l1 = vms_new_page();
+    void* l0 = vms_new_page();
+
+    uint64_t* l2_entry = vms_page_table_pte_entry(l2, base, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+
+    uint64_t* l1_entry = vms_page_table_pte_entry(l1, base, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(l0));
+    vms_pte_valid_set(l1_entry);
+
+    for (int i = 0; i < MAPPED_PAGES; ++i) {
+        uint64_t* l0_entry = vms_page_table_pte_entry(l0,
+                                                      base + i * PAGE_SIZE,
+                                                      0);
+        vms_pte_set_ppn(l0_entry, vms_page_to_ppn(vms_new_page()));
+        vms_pte_valid_set(l0_entry);
+        vms_pte_read_set(l0_entry);
+        vms_pte_write_set(l0_entry);
+    }
+    vms_set_root_page_table(l2);
+}
+
+static void report(const char* name, size_t bytes, double seconds) {
+    printf("%-16s %10.1f MiB/s\n", name, bytes / seconds / (1 << 20));
+}
+
+int main() {
+    if (vms_init_pool(MAPPED_PAGES + 16) != 0) {
+        return 1;
+    }
+    map_region();
+
+    size_t length = (size_t) MAPPED_PAGES * PAGE_SIZE;
+    int* buffer = malloc(length);
+    if (buffer == NULL) {
+        return 1;
+    }
+    memset(buffer, 1, length);
+    size_t count = length / sizeof(int);
+
+    double start = now();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < count; ++i) {
+            vms_write(base + i * sizeof(int), buffer[i]);
+        }
+    }
+    report("vms_write", length * ROUNDS, now() - start);
+
+    start = now();
+    for (int round = 0; round < ROUNDS; ++round) {
+        vms_write_range(base, buffer, length);
+    }
+    report("vms_write_range", length * ROUNDS, now() - start);
+
+    start = now();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (size_t i = 0; i < count; ++i) {
+            buffer[i] = vms_read(base + i * sizeof(int));
+        }
+    }
+    report("vms_read", length * ROUNDS, now() - start);
+
+    start = now();
+    for (int round = 0; round < ROUNDS; ++round) {
+        vms_read_range(base, buffer, length);
+    }
+    report("vms_read_range", length * ROUNDS, now() - start);
+
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "vms.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/* Far more pages than the TLB holds, so every read walks the tables */
+#define MAPPED_PAGES (1 << 14)
+#define ROUNDS 50
+
+static uint8_t* const base = (uint8_t*) 0x40000000;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+    if (vms_init_pool(MAPPED_PAGES + MAPPED_PAGES / 512 + 16) != 0) {
+        return 1;
+    }
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    if (vms_map_range(base, (size_t) MAPPED_PAGES * PAGE_SIZE,
+                      VMS_PROT_READ | VMS_PROT_WRITE,
+                      VMS_MAP_POPULATE) != 0) {
+        return 1;
+    }
+
+    vms_tlb_reset_stats();
+    long sum = 0;
+    double start = now();
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int page = 0; page < MAPPED_PAGES; ++page) {
+            sum += vms_read(base + (size_t) page * PAGE_SIZE);
+        }
+    }
+    double seconds = now() - start;
+
+    struct vms_tlb_stats stats;
+    vms_tlb_get_stats(&stats);
+    printf("%-16s %10.1f M/s\n", "walks", stats.misses / seconds / 1e6);
+    printf("%-16s %10.1f M/s\n", "reads", (double) MAPPED_PAGES * ROUNDS / seconds / 1e6);
+    printf("%-16s %10.1f %%\n", "tlb misses",
+           100.0 * stats.misses / (stats.hits + stats.misses));
+    printf("%-16s %10.1f %%\n", "walk cache hits",
+           100.0 * stats.walk_cache_hits / (stats.walk_cache_hits + stats.walk_cache_misses));
+
+    vms_destroy_address_space(l2);
+    return sum != 0;
+}
@@ -45,6 +45,36 @@ test_weights = {
     'cow-7': 7,
     'cow-8': 7,
     'cow-9': 7,
+    'asid-1': 0,
+    'asid-2': 0,
+    'cow-shared-1': 0,
+    'demand-1': 0,
+    'demand-2': 0,
+    'destroy-1': 0,
+    'dirty-1': 0,
+    'file-1': 0,
+    'huge-1': 0,
+    'levels-1': 0,
+    'merge-1': 0,
+    'occupancy-1': 0,
+    'pages-1': 0,
+    'parallel-1': 0,
+    'parallel-2': 0,
+    'pool-1': 0,
+    'profile-1': 0,
+    'profile-2': 0,
+    'profile-3': 0,
+    'range-1': 0,
+    'refcount-1': 0,
+    'shared-1': 0,
+    'snapshot-1': 0,
+    'snapshot-2': 0,
+    'swap-1': 0,
+    'swap-2': 0,
+    'threads-1': 0,
+    'tlb-1': 0,
+    'tlb-2': 0,
+    'tlb-3': 0,
 }
 
 grade = 0
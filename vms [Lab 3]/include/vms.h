@@ -1,21 +1,187 @@
 #ifndef VMS_H
 #define VMS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (512 * PAGE_SIZE)
 
 /* MMU */
 void vms_write(void* pointer, int value);
 int vms_read(void* pointer);
+void vms_read_range(void* pointer, void* buffer, size_t length);
+void vms_write_range(void* pointer, const void* buffer, size_t length);
+void vms_memcpy_virtual(void* destination, void* source, size_t length);
 void* vms_get_root_page_table();
 void vms_set_root_page_table(void* pointer);
+void vms_unmap(void* pointer);
+/* Page table levels the library was built with, each translating 9 bits
+   of the virtual address above the 12 bit page offset */
+int vms_get_levels();
+
+/* Address spaces */
+int vms_asid_create(void* root_page_table);
+int vms_asid_release(int asid);
+int vms_switch(int asid);
+int vms_get_asid();
+void* vms_asid_root_page_table(int asid);
+
+/* Mappings */
+#define VMS_PROT_READ 0x1
+#define VMS_PROT_WRITE 0x2
+#define VMS_MAP_POPULATE 0x1
+/* Forks map the same pages instead of copying them, so writes from any
+   address space are seen by all of them */
+#define VMS_MAP_SHARED 0x2
+int vms_map_range(void* pointer, size_t length, int prot, int flags);
+/* Like vms_map_range, with pages read from `fd` at `offset` on first
+   touch (zeros past the end of the file). Private mappings never write
+   back. Shared ones do on vms_sync, and only then. The descriptor is
+   duplicated, so the caller may close it. */
+int vms_map_file(void* pointer, size_t length, int prot, int flags,
+                 int fd, uint64_t offset);
+/* Write the pages of shared file mappings in the range that the current
+   address space dirtied back to their files */
+int vms_sync(void* pointer, size_t length);
+struct vms_file_stats {
+    uint64_t page_reads;
+    uint64_t page_writes;
+    uint64_t io_nanoseconds; //spent in reads and writes
+};
+void vms_file_get_stats(struct vms_file_stats* stats);
+void vms_file_reset_stats();
+
+/* TLB */
+struct vms_tlb_stats {
+    uint64_t hits;
+    uint64_t misses;
+    /* Misses whose walk found (or did not find) its level 0 table in the
+       walk cache and read only the leaf entry */
+    uint64_t walk_cache_hits;
+    uint64_t walk_cache_misses;
+};
+void vms_tlb_flush();
+void vms_tlb_flush_asid(int asid);
+void vms_tlb_get_stats(struct vms_tlb_stats* stats);
+void vms_tlb_reset_stats();
+
+/* Swap */
+struct vms_swap_stats {
+    uint64_t faults;
+    uint64_t major_faults;
+    uint64_t evictions;
+    uint64_t swap_reads;
+    uint64_t swap_writes;
+};
+int vms_swap_enable(const char* path, size_t slots);
+int vms_swap_disable();
+void vms_swap_get_stats(struct vms_swap_stats* stats);
+void vms_swap_reset_stats();
+
+/* Profiling */
+#define VMS_PROFILE_COUNTERS 0x1
+#define VMS_PROFILE_TRACE 0x2
+/* Room for any page table depth */
+#define VMS_PROFILE_LEVELS 8
+
+enum vms_event_type {
+    VMS_EVENT_TRANSLATION, //address translated, level of the leaf
+    VMS_EVENT_WALK, //TLB miss walked from level value down to the leaf at level
+    VMS_EVENT_FAULT, //page_fault_handler ran at level, value the vms_fault_reason
+    VMS_EVENT_COW_FAULT, //write to a copy-on-write page
+    VMS_EVENT_COPY, //the fault handler copied value bytes
+    VMS_EVENT_ALLOC, //address is the first pool page, value the count
+    VMS_EVENT_FREE,
+    VMS_EVENT_FORK, //address is the child root, value the nanoseconds taken
+    VMS_EVENT_TYPES,
+};
+
+/* Why an access faulted, from the entry at the faulting level */
+enum vms_fault_reason {
+    VMS_FAULT_NOT_PRESENT, //no valid entry: demand paging, or not mapped
+    VMS_FAULT_SWAPPED, //the page was evicted to swap
+    VMS_FAULT_SHARED_TABLE, //write through a page table shared copy-on-write
+    VMS_FAULT_COPY_ON_WRITE, //write to a copy-on-write page
+    VMS_FAULT_PROTECTION, //the entry does not allow the access
+    VMS_FAULT_REASONS,
+};
+
+struct vms_event {
+    uint64_t time; //nanoseconds since profiling was enabled
+    uint64_t space; //root page table current when it happened
+    uint64_t address;
+    uint64_t value;
+    uint32_t type;
+    int32_t level;
+};
+
+/* Events counted while an address space was current. Frees of a destroyed
+   address space's pages count towards whichever space is current. */
+struct vms_counters {
+    uint64_t translations;
+    uint64_t walks[VMS_PROFILE_LEVELS]; //entries read at each level
+    uint64_t faults;
+    uint64_t fault_reasons[VMS_FAULT_REASONS];
+    uint64_t cow_faults;
+    uint64_t copies;
+    uint64_t copied_bytes;
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t forks;
+    uint64_t fork_nanoseconds;
+};
+
+/* Header of a file written by vms_trace_dump, followed by `events` events
+   oldest first */
+#define VMS_TRACE_MAGIC "VMSTRACE"
+struct vms_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t levels;
+    uint64_t events;
+    uint64_t dropped; //overwritten because the ring was full
+};
+
+/* Counting adds an atomic increment per event, tracing keeps the last
+   `trace_events` events in a ring. Enabling again resets the trace.
+   Either call waits for the translations and faults in progress. */
+int vms_profile_enable(int flags, size_t trace_events);
+void vms_profile_disable();
+int vms_get_counters(void* root_page_table, struct vms_counters* counters);
+void vms_reset_counters(void* root_page_table);
+/* Copy up to `max` of the most recent events, oldest first. Events still
+   being recorded, or overwritten while copying, are left out. */
+size_t vms_trace_read(struct vms_event* events, size_t max);
+int vms_trace_dump(const char* path);
+
+/* Same-page merging */
+struct vms_merge_stats {
+    uint64_t scanned; //resident 4 KiB data pages visited
+    uint64_t merged; //entries pointed at an identical page
+    uint64_t zero_pages; //of those, all-zero pages
+    uint64_t reclaimed; //pool pages freed
+};
+/* Map identical data pages of the `count` address spaces to one shared
+   frame, copy-on-write for writable mappings. NULL means the current
+   address space. Huge and swapped pages are left alone. */
+int vms_merge_pages(void** root_page_tables,
+                    size_t count,
+                    struct vms_merge_stats* stats);
 
 /* Pages */
 void vms_init();
+/* Up to 1 << 28 pages (1 TiB). The pool and its metadata are only
+   reserved, memory is committed as pages are first used. */
+int vms_init_pool(size_t max_pages);
+size_t vms_get_max_pages();
 void* vms_new_page();
+void* vms_new_huge_page();
 void vms_free_page(void*);
 int vms_get_used_pages();
+void vms_page_ref(void* pointer);
+void vms_page_unref(void* pointer);
+int vms_page_ref_count(void* pointer);
 void* vms_get_page_pointer(int index);
 int vms_get_page_index(void* pointer);
 
@@ -25,10 +191,14 @@ uint64_t* vms_page_table_pte_entry_from_index(void* page_table, int index);
 uint64_t* vms_page_table_pte_entry(void* page_table,
                                    void* virtual_address,
                                    int level);
+int vms_page_table_next_valid(void* page_table, int index);
+int vms_page_table_valid_count(void* page_table);
 void* vms_ppn_to_page(uint64_t ppn);
 uint64_t vms_page_to_ppn(void* pointer);
 
-/* PTE */
+/* PTE. Setters that change a valid entry flush the TLB and the walk
+   cache, since translations may have been cached through it. Edits made
+   without them, through the entry's memory, need vms_tlb_flush(). */
 void vms_pte_valid_clear(uint64_t* entry);
 void vms_pte_valid_set(uint64_t* entry);
 int vms_pte_valid(uint64_t* entry);
@@ -41,11 +211,42 @@ int vms_pte_write(uint64_t* entry);
 void vms_pte_custom_clear(uint64_t* entry);
 void vms_pte_custom_set(uint64_t* entry);
 int vms_pte_custom(uint64_t* entry);
+void vms_pte_huge_clear(uint64_t* entry);
+void vms_pte_huge_set(uint64_t* entry);
+int vms_pte_huge(uint64_t* entry);
+void vms_pte_accessed_clear(uint64_t* entry);
+void vms_pte_accessed_set(uint64_t* entry);
+int vms_pte_accessed(uint64_t* entry);
+void vms_pte_dirty_clear(uint64_t* entry);
+void vms_pte_dirty_set(uint64_t* entry);
+int vms_pte_dirty(uint64_t* entry);
+void vms_pte_swapped_clear(uint64_t* entry);
+void vms_pte_swapped_set(uint64_t* entry);
+int vms_pte_swapped(uint64_t* entry);
 uint64_t vms_pte_get_ppn(uint64_t* entry);
 void vms_pte_set_ppn(uint64_t* entry, uint64_t ppn);
 
 /* VMS */
 void* vms_fork_copy();
+void* vms_fork_copy_parallel(int threads);
 void* vms_fork_copy_on_write();
+void* vms_fork_copy_on_write_shared();
+void vms_destroy_address_space(void* root_page_table);
+/* A read-only copy-on-write checkpoint of an address space, itself rooted
+   at the returned page table, or NULL with errno set. Only pages written
+   afterwards are copied, except those of VMS_MAP_SHARED mappings, which
+   the snapshot shares. A write with the snapshot as the root page table
+   is a fatal page fault. Release it with vms_destroy_address_space. */
+void* vms_snapshot(void* root_page_table);
+/* Roll the address space the snapshot was taken of back to it, mappings
+   included. The snapshot stays usable. EINVAL if that address space was
+   destroyed. */
+int vms_restore(void* snapshot);
+/* Virtual addresses of the resident pages (or huge pages) of the current
+   address space with the accessed or dirty bit set. At most `max` are
+   stored in `addresses`, which may be NULL to only count them; the return
+   value is the total. With `clear`, the bits are cleared as they are read. */
+size_t vms_scan_accessed(void** addresses, size_t max, int clear);
+size_t vms_scan_dirty(void** addresses, size_t max, int clear);
 
 #endif
@@ -0,0 +1,192 @@
+#include "vms.h"
+
+#include "mapping.h"
+#include "mmu.h"
+#include "pages.h"
+#include "profile.h"
+#include "pte.h"
+#include "space.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static struct vms_file_stats stats;
+
+void vms_file_get_stats(struct vms_file_stats* result) {
+    *result = stats;
+}
+
+void vms_file_reset_stats() {
+    stats = (struct vms_file_stats) {0};
+}
+
+static off_t file_offset(struct region* region, uint64_t address) {
+    return (off_t) (region->offset + (address - region->start));
+}
+
+/* Past the end of the file the page stays zero-filled */
+static void file_read(struct region* region, uint64_t address, void* page) {
+    uint64_t start = profile_clock();
+    size_t done = 0;
+    while (done < PAGE_SIZE) {
+        ssize_t n = pread(region->fd, (uint8_t*) page + done, PAGE_SIZE - done,
+                          file_offset(region, address) + done);
+        if (n == -1) {
+            perror("file_read");
+            exit(EIO); //no way to report it from the faulting access
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    ++stats.page_reads;
+    stats.io_nanoseconds += profile_clock() - start;
+}
+
+static int file_write(struct region* region, uint64_t address, void* page) {
+    uint64_t start = profile_clock();
+    ssize_t n = pwrite(region->fd, page, PAGE_SIZE, file_offset(region, address));
+    if (n != PAGE_SIZE) {
+        return n == -1 ? errno : EIO;
+    }
+    ++stats.page_writes;
+    stats.io_nanoseconds += profile_clock() - start;
+    return 0;
+}
+
+void* mapping_fault_page(struct region* region, void* virtual_address) {
+    uint64_t address = (uint64_t) virtual_address & ~(uint64_t) (PAGE_SIZE - 1);
+    struct shared_page* shared = NULL;
+    if (region->shared != NULL) {
+        shared = &region->shared->pages[(address - region->start) / PAGE_SIZE];
+        if (shared->page != NULL) {
+            vms_page_ref(shared->page);
+            return shared->page;
+        }
+    }
+
+    void* page = vms_new_page();
+    if (page == NULL) {
+        return NULL;
+    }
+    if (region->fd != -1) {
+        file_read(region, address, page);
+    }
+    if (shared != NULL) {
+        vms_page_ref(page); //the region's reference
+        shared->page = page;
+    }
+    return page;
+}
+
+static int file_shared(struct region* region) {
+    return region != NULL && region->fd != -1 && region->shared != NULL;
+}
+
+static struct shared_page* shared_page(struct region* region, uint64_t address) {
+    return &region->shared->pages[(address - region->start) / PAGE_SIZE];
+}
+
+/* The resident level 0 entry of `address`, or NULL */
+static uint64_t* resident_entry(void* page_table, uint64_t address) {
+    for (int level = MMU_LEVELS - 1; level > 0; --level) {
+        uint64_t* entry = page_table_entry(page_table, (void*) address, level);
+        if (!pte_valid(entry) || pte_huge(entry)) {
+            return NULL;
+        }
+        page_table = ppn_to_page(pte_get_ppn(entry));
+    }
+    uint64_t* entry = page_table_entry(page_table, (void*) address, 0);
+    return pte_valid(entry) ? entry : NULL;
+}
+
+void mapping_drop_entry(void* root_page_table, void* virtual_address, uint64_t* entry) {
+    if (!pte_shared(entry) || !pte_dirty(entry)) {
+        return;
+    }
+    struct region* region = space_find_region(root_page_table, virtual_address);
+    if (file_shared(region)) {
+        shared_page(region, (uint64_t) virtual_address)->dirty = 1;
+    }
+}
+
+void mapping_drop_space(void* root_page_table) {
+    struct address_space* space = space_get(root_page_table);
+    if (space == NULL) {
+        return;
+    }
+    for (struct region* region = space->regions;
+         region != NULL;
+         region = region->next) {
+        if (!file_shared(region)) {
+            continue;
+        }
+        for (uint64_t address = region->start; address < region->end; address += PAGE_SIZE) {
+            uint64_t* entry = resident_entry(root_page_table, address);
+            if (entry != NULL && pte_dirty(entry)) {
+                shared_page(region, address)->dirty = 1;
+            }
+        }
+    }
+}
+
+static int write_back(struct region* region, uint64_t address) {
+    struct shared_page* shared = shared_page(region, address);
+    if (!shared->dirty) {
+        return 0;
+    }
+    int err = file_write(region, address, shared->page);
+    if (err == 0) {
+        shared->dirty = 0;
+    }
+    return err;
+}
+
+void mapping_release_region(struct region* region) {
+    if (!file_shared(region) || region->shared->references != 1) {
+        return;
+    }
+    for (uint64_t address = region->start; address < region->end; address += PAGE_SIZE) {
+        int err = write_back(region, address);
+        if (err != 0) {
+            errno = err;
+            perror("mapping_release_region"); //no one left to report it to
+        }
+    }
+}
+
+static int sync_range(uint64_t start, uint64_t end) {
+    void* root_page_table = vms_get_root_page_table();
+    for (uint64_t address = start; address < end; address += PAGE_SIZE) {
+        struct region* region = space_find_region(root_page_table, (void*) address);
+        if (!file_shared(region)) {
+            continue; //private and anonymous pages have nowhere to go
+        }
+        /* Pages dirtied by other address spaces are written as well, once
+           their entries were synced or went away */
+        uint64_t* entry = resident_entry(root_page_table, address);
+        if (entry != NULL && pte_dirty(entry)) {
+            shared_page(region, address)->dirty = 1;
+            pte_flag_clear(entry, PTE_DIRTY);
+        }
+        int err = write_back(region, address);
+        if (err != 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+int vms_sync(void* pointer, size_t length) {
+    uint64_t start = (uint64_t) pointer;
+    if (start % PAGE_SIZE != 0 || vms_get_root_page_table() == NULL) {
+        return EINVAL;
+    }
+    /* Exclusively, so no write lands between the copy and the clear */
+    mmu_lock_exclusive();
+    int err = sync_range(start, start + length);
+    mmu_unlock();
+    return err;
+}
@@ -0,0 +1,22 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include "space.h"
+
+/* The data page to map at `virtual_address` in `region`, holding a
+   reference for the entry about to map it: the region's shared page if it
+   is VMS_MAP_SHARED, otherwise a new one. Pages new to a file mapping are
+   read from the file. NULL if the pool is out of memory. */
+void* mapping_fault_page(struct region* region, void* virtual_address);
+/* The level 0 entry `entry` mapping `virtual_address` in the address space
+   rooted at `root_page_table` is going away: remember if it wrote to a
+   shared file page */
+void mapping_drop_entry(void* root_page_table, void* virtual_address, uint64_t* entry);
+/* The same for every resident entry of the shared file mappings of the
+   address space, before its tables are released */
+void mapping_drop_space(void* root_page_table);
+/* `region` is about to be freed. If it holds the last reference to its
+   shared pages, the dirty ones are written back to the file. */
+void mapping_release_region(struct region* region);
+
+#endif
@@ -0,0 +1,145 @@
+#include "vms.h"
+
+#include "mmu.h"
+#include "pages.h"
+#include "pte.h"
+#include "swap.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Data pages seen in one merging pass, by content hash. A page that
+   collides with a different page of the same hash is simply not merged. */
+struct merge_slot {
+    uint64_t hash;
+    void* page;
+    uint64_t* entry; //first entry seen mapping `page`, until its first merge
+};
+
+struct merge_pass {
+    struct merge_slot* slots;
+    size_t mask;
+    struct vms_merge_stats* stats;
+};
+
+static uint64_t page_hash(const void* page) {
+    const uint64_t* words = page;
+    uint64_t hash = 0x9E3779B97F4A7C15;
+    for (int i = 0; i < PAGE_SIZE / 8; ++i) {
+        hash = (hash ^ words[i]) * 0xFF51AFD7ED558CCD;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+static int page_is_zero(const void* page) {
+    const uint64_t* words = page;
+    for (int i = 0; i < PAGE_SIZE / 8; ++i) {
+        if (words[i] != 0) return 0;
+    }
+    return 1;
+}
+
+/* The slot of the page already seen with the same contents, or NULL
+   after recording `page`, mapped by `entry`, as the one to merge later
+   pages into */
+static struct merge_slot* merge_find(struct merge_pass* pass, void* page, uint64_t* entry) {
+    uint64_t hash = page_hash(page);
+    for (size_t i = hash & pass->mask; ; i = (i + 1) & pass->mask) {
+        struct merge_slot* slot = &pass->slots[i];
+        if (slot->page == NULL) {
+            slot->hash = hash;
+            slot->page = page;
+            slot->entry = entry;
+            return NULL;
+        }
+        if (slot->page == page) {
+            return NULL;
+        }
+        if (slot->hash == hash) {
+            return memcmp(slot->page, page, PAGE_SIZE) == 0 ? slot : NULL;
+        }
+    }
+}
+
+/* Writable entries become copy-on-write, so page_fault_handler copies
+   the page again on the next write; read-only ones stay read-only */
+static void make_copy_on_write(uint64_t* entry) {
+    if (pte_write(entry)) {
+        pte_flag_clear(entry, PTE_WRITE);
+        pte_flag_set(entry, PTE_CUSTOM);
+    }
+}
+
+/* Point `entry` at `shared` instead of its own identical page, copy-on-write */
+static void merge_entry(uint64_t* entry, void* shared) {
+    void* page = ppn_to_page(pte_get_ppn(entry));
+    if (*page_swap_copy(shared) != 0) {
+        /* Entries whose dirty bit refers to another page now use this one,
+           so its copy in swap can no longer be trusted */
+        swap_drop_copy(shared);
+    }
+    vms_page_ref(shared);
+    pte_set_ppn(entry, page_to_ppn(shared));
+    make_copy_on_write(entry);
+    vms_page_unref(page);
+}
+
+static void merge_page_table(struct merge_pass* pass, void* page_table, int level) {
+    for (int i = page_table_next_valid(page_table, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(page_table, i + 1)) {
+        uint64_t* entry = page_table_entry_from_index(page_table, i);
+        if (!pte_valid(entry) || pte_huge(entry)) continue; //swapped out or a huge page
+        if (level == 0 && pte_shared(entry)) continue; //other address spaces must keep seeing its writes
+
+        void* page = ppn_to_page(pte_get_ppn(entry));
+        if (level != 0) {
+            merge_page_table(pass, page, level - 1);
+            continue;
+        }
+        ++pass->stats->scanned;
+        struct merge_slot* slot = merge_find(pass, page, entry);
+        if (slot == NULL) continue;
+
+        if (slot->entry != NULL) { //the kept frame is shared from now on, so its first entry may not write either
+            make_copy_on_write(slot->entry);
+            slot->entry = NULL;
+        }
+        ++pass->stats->merged;
+        if (page_is_zero(slot->page)) ++pass->stats->zero_pages;
+        merge_entry(entry, slot->page);
+    }
+}
+
+static int merge_pages(void** root_page_tables, size_t count, struct vms_merge_stats* stats) {
+    /* At most every used page is a data page, keep the table half empty */
+    size_t capacity = 16;
+    while (capacity < 2 * (size_t) vms_get_used_pages()) capacity *= 2;
+    struct merge_pass pass = {calloc(capacity, sizeof(struct merge_slot)), capacity - 1, stats};
+    if (pass.slots == NULL) return ENOMEM;
+
+    int used = vms_get_used_pages();
+    for (size_t i = 0; i < count; ++i) {
+        merge_page_table(&pass, root_page_tables[i], MMU_LEVELS - 1);
+    }
+    stats->reclaimed = used - vms_get_used_pages();
+    free(pass.slots);
+    return 0;
+}
+
+int vms_merge_pages(void** root_page_tables, size_t count, struct vms_merge_stats* stats) {
+    struct vms_merge_stats ignored;
+    if (stats == NULL) stats = &ignored;
+    *stats = (struct vms_merge_stats) {0};
+
+    void* current = vms_get_root_page_table();
+    if (root_page_tables == NULL) {
+        if (current == NULL) return EINVAL;
+        root_page_tables = &current;
+        count = 1;
+    }
+    mmu_lock_exclusive();
+    int err = merge_pages(root_page_tables, count, stats);
+    mmu_unlock();
+    return err;
+}
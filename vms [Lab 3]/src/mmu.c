@@ -1,27 +1,102 @@
 #include "vms.h"
 
+#include "mapping.h"
 #include "mmu.h"
 #include "pages.h"
+#include "profile.h"
+#include "pte.h"
+#include "space.h"
+#include "swap.h"
+#include "tlb.h"
 
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define MMU_LEVELS 3
+/* Each thread has its own current address space, like each CPU */
+static _Thread_local void* root_page_table = NULL;
+/* TLB tag of the current address space, see tlb.h, and the ASID
+   generation it was computed in */
+static _Thread_local uint64_t root_tag = 0;
+static _Thread_local uint64_t tag_generation = 0;
+/* The current address space is a snapshot, which takes no writes */
+static _Thread_local int read_only = 0;
+/* Times this thread gave up its shared hold on the MMU lock to fault */
+static _Thread_local uint64_t faults_taken = 0;
 
-static void* root_page_table = NULL;
+/* Translations and the accesses through them hold the MMU lock shared.
+   Faults and anything else that changes the page table structure hold it
+   exclusively, so readers never see a table being replaced or freed. A
+   thread waiting for the exclusive lock keeps new shared holders out, so
+   faults are not starved. The lock is two counters rather than a
+   pthread_rwlock_t, which keeps a shared hold to two atomic operations. */
+static int mmu_writer = 0;
+static int mmu_readers = 0;
+/* How this thread holds the lock: 0, 1 for shared, -1 for exclusive, 2
+   when it works for a thread holding it exclusively */
+static _Thread_local int held = 0;
 
-static int should_generate_fault(int level, uint64_t* entry) {
-    if (!vms_pte_valid(entry)) {
-        return 1;
+void mmu_lock_shared() {
+    for (;;) {
+        while (__atomic_load_n(&mmu_writer, __ATOMIC_ACQUIRE) != 0) {
+            sched_yield();
+        }
+        __atomic_add_fetch(&mmu_readers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&mmu_writer, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
+        __atomic_sub_fetch(&mmu_readers, 1, __ATOMIC_RELEASE); //back off
     }
-    else if (level != 0 && (vms_pte_read(entry) || vms_pte_write(entry))) {
-        return 1;
+    held = 1;
+}
+
+void mmu_lock_exclusive() {
+    int expected = 0;
+    while (!__atomic_compare_exchange_n(&mmu_writer, &expected, 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        expected = 0;
+        sched_yield();
+    }
+    while (__atomic_load_n(&mmu_readers, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    held = -1;
+}
+
+void mmu_unlock() {
+    if (held == 1) {
+        __atomic_sub_fetch(&mmu_readers, 1, __ATOMIC_RELEASE);
     }
-    else  if (level == 0 && !vms_pte_read(entry) && !vms_pte_write(entry)) {
-        return 1;
+    else {
+        __atomic_store_n(&mmu_writer, 0, __ATOMIC_RELEASE);
     }
-    return 0;
+    held = 0;
+}
+
+int mmu_lock_held() {
+    return held != 0;
+}
+
+void mmu_lock_borrow(void* owner_root_page_table) {
+    held = 2;
+    root_page_table = owner_root_page_table;
+}
+
+void mmu_lock_return() {
+    held = 0;
+    root_page_table = NULL;
+}
+
+/* Level 0 entries are always leaves, level 1 entries are leaves when they
+   map a huge page */
+static int is_leaf(int level, uint64_t* entry) {
+    return level == 0 || (level == 1 && pte_huge(entry));
+}
+
+int vms_get_levels() {
+    return MMU_LEVELS;
 }
 
 void* vms_get_root_page_table() {
@@ -31,113 +106,465 @@ void* vms_get_root_page_table() {
 void vms_set_root_page_table(void* page_table) {
     check_page_aligned(page_table);
     root_page_table = page_table;
+    struct address_space* space = space_get(page_table);
+    read_only = space != NULL && space->snapshot_of != NULL;
+    mmu_update_tag();
+}
+
+void mmu_update_tag() {
+    tag_generation = space_asid_generation();
+    int asid = space_asid(root_page_table);
+    root_tag = asid != 0 ? (uint64_t) asid : (uint64_t) root_page_table;
+}
+
+/* Another thread may have assigned or released the ASID of the current
+   address space, or recycled the one this thread last saw for it. ASIDs
+   only change with the lock held exclusively, so with it held either way
+   the tag stays valid once refreshed. */
+static void refresh_tag() {
+    if (root_page_table != NULL && space_asid_generation() != tag_generation) {
+        mmu_update_tag();
+    }
+}
+
+uint64_t mmu_tag() {
+    refresh_tag();
+    return root_tag;
 }
 
+static const char* fault_reason_names[VMS_FAULT_REASONS] = {
+    "not present", "swapped", "shared table", "copy-on-write", "protection",
+};
+
 static void print_fatal_page_fault(void* virtual_address,
                                    int level,
-                                   void* page_table) {
-    uint64_t* entry = vms_page_table_pte_entry(page_table,
-                                               virtual_address,
-                                               level);
+                                   void* page_table,
+                                   enum vms_fault_reason reason) {
+    uint64_t* entry = page_table_entry(page_table, virtual_address, level);
     const char* dash = "-";
     const char* custom = dash;
     const char* write = dash;
     const char* read = dash;
     const char* valid = dash;
-    if (vms_pte_custom(entry)) {
+    if (pte_custom(entry)) {
         custom = "C";
     }
-    if (vms_pte_write(entry)) {
+    if (pte_write(entry)) {
         write = "W";
     }
-    if (vms_pte_read(entry)) {
+    if (pte_read(entry)) {
         read = "R";
     }
-    if (vms_pte_valid(entry)) {
+    if (pte_valid(entry)) {
         valid = "V";
     }
 
     printf("Fatal page fault!\n"
+           "  Reason: %s\n"
            "  Virtual address: 0x%lX\n"
            "  Page table: 0x%lX\n"
            "  Level: %d\n"
            "  PTE:\n"
            "    PPN: 0x%lX\n"
            "    Flags: %s%s%s%s\n", 
+           fault_reason_names[reason],
            (uint64_t) virtual_address,
            (uint64_t) page_table,
            level,
-           vms_pte_get_ppn(entry),
+           pte_get_ppn(entry),
            custom, write, read, valid);
 }
 
-static uint64_t* mmu(void* virtual_address) {
-    void* page_table = root_page_table;
-    int faulted = 0;
+/* Access intents: what the translation is for decides which entries
+   fault on the way */
+#define INTENT_READ 0
+#define INTENT_WRITE 1
+#define NO_FAULT -1
+
+/* Why an access with `intent` faults on the leaf entry `pte`, or
+   NO_FAULT */
+static inline int leaf_fault(uint64_t pte, int intent) {
+    if ((pte & PTE_VALID) == 0) {
+        return (pte & PTE_SWAPPED) != 0 ? VMS_FAULT_SWAPPED : VMS_FAULT_NOT_PRESENT;
+    }
+    uint64_t permission = intent == INTENT_WRITE ? PTE_WRITE : PTE_READ;
+    if ((pte & permission) != 0) {
+        return NO_FAULT;
+    }
+    if (intent == INTENT_WRITE && (pte & PTE_CUSTOM) != 0) {
+        return VMS_FAULT_COPY_ON_WRITE;
+    }
+    return VMS_FAULT_PROTECTION;
+}
+
+/* Same for an entry pointing to a lower table. Writes may not go through
+   a table shared copy-on-write, reads may. */
+static inline int table_fault(uint64_t pte, int intent) {
+    if ((pte & PTE_VALID) == 0) {
+        return VMS_FAULT_NOT_PRESENT;
+    }
+    if ((pte & (PTE_READ | PTE_WRITE)) != 0) {
+        return VMS_FAULT_PROTECTION; //not a leaf, so rights make no sense
+    }
+    if (intent == INTENT_WRITE && (pte & PTE_CUSTOM) != 0) {
+        return VMS_FAULT_SHARED_TABLE;
+    }
+    return NO_FAULT;
+}
+
+static void mark_accessed(uint64_t* entry, int intent) {
+    if (!pte_accessed(entry)) {
+        pte_flag_set(entry, PTE_ACCESSED); //referenced, for page replacement
+    }
+    if (intent == INTENT_WRITE && !pte_dirty(entry)) {
+        pte_flag_set(entry, PTE_DIRTY);
+    }
+}
+
+/* The walk for translations that do not fault, returning why one does
+   otherwise. A walk cache hit reads the level 0 entry only. Otherwise the
+   loop is fully unrolled, so `level` is a constant in each copy and the
+   leaf tests fold away; each entry is loaded once. `top` is the first
+   level read. Shared tables on the path only set `shared_path` here, so
+   reads through them are cached in the TLB as well. */
+static inline int walk(void* virtual_address,
+                       int intent,
+                       struct translation* translation,
+                       int* top) {
+    void* page_table;
+    if (tlb_walk_cache_lookup(root_tag, virtual_address,
+                              &page_table, &translation->shared_path)) {
+        uint64_t* entry = page_table_entry(page_table, virtual_address, 0);
+        *top = 0;
+        translation->entry = entry;
+        translation->level = 0;
+        return leaf_fault(pte_load(entry), intent);
+    }
+
+    page_table = root_page_table;
+    translation->shared_path = 0;
+    *top = MMU_LEVELS - 1;
+#pragma GCC unroll 8
     for (int level = MMU_LEVELS - 1; level >= 0; --level) {
-        uint64_t* entry = vms_page_table_pte_entry(page_table,
-                                                   virtual_address,
-                                                   level);
-
-        if (should_generate_fault(level, entry)) {
-            if (!faulted) {
-                faulted = 1;
-                page_fault_handler(virtual_address, level, page_table);
-                ++level;
-                continue;
+        uint64_t* entry = page_table_entry(page_table, virtual_address, level);
+        uint64_t pte = pte_load(entry);
+        if (level == 0 || (level == 1 && (pte & PTE_HUGE) != 0)) {
+            translation->entry = entry;
+            translation->level = level;
+            return leaf_fault(pte, intent);
+        }
+        int fault = table_fault(pte, INTENT_READ);
+        if (fault != NO_FAULT) {
+            return fault;
+        }
+        if ((pte & PTE_CUSTOM) != 0) {
+            translation->shared_path = 1;
+        }
+        page_table = ppn_to_page((pte & PTE_PPN_MASK) >> PTE_PPN_START_BIT);
+        if (level == 1) {
+            tlb_walk_cache_insert(root_tag, virtual_address,
+                                  page_table, translation->shared_path);
+        }
+    }
+    __builtin_unreachable();
+}
+
+/* Translates with the lock held shared, without faulting: the TLB, then a
+   walk. Returns why the access faults, or NO_FAULT. */
+static int lookup(void* virtual_address,
+                  int intent,
+                  struct translation* translation) {
+    refresh_tag();
+    if (tlb_lookup(root_tag, virtual_address, translation)
+        && is_leaf(translation->level, translation->entry)
+        && leaf_fault(pte_load(translation->entry), intent) == NO_FAULT
+        && (intent == INTENT_READ || !translation->shared_path)) {
+        return NO_FAULT;
+    }
+    int top;
+    int fault = walk(virtual_address, intent, translation, &top);
+    if (fault == NO_FAULT && intent == INTENT_WRITE && translation->shared_path) {
+        fault = VMS_FAULT_SHARED_TABLE;
+    }
+    if (fault == NO_FAULT) {
+        profile_event(VMS_EVENT_WALK, virtual_address, translation->level, top);
+        tlb_insert(root_tag, virtual_address, translation);
+    }
+    return fault;
+}
+
+/* Called with the lock held shared after `lookup` failed. Takes the lock
+   exclusively once and, in one pass from the root, runs the handler on
+   each level that still faults for `intent`: missing tables and pages,
+   swapped pages, shared tables and the copy-on-write leaf. A handler that
+   leaves its entry unchanged cannot make progress, which is fatal. */
+static void resolve_fault(void* virtual_address, int intent) {
+    mmu_unlock();
+    mmu_lock_exclusive();
+    ++faults_taken;
+    refresh_tag();
+
+    uint64_t* faulting_entry = NULL;
+    uint64_t faulting_pte = 0;
+    for (;;) {
+        void* page_table = root_page_table;
+        int level = MMU_LEVELS - 1;
+        int fault = NO_FAULT;
+        struct translation translation = {0};
+        uint64_t* entry;
+        for (;; --level) {
+            entry = page_table_entry(page_table, virtual_address, level);
+            uint64_t pte = pte_load(entry);
+            int leaf = level == 0 || (level == 1 && (pte & PTE_HUGE) != 0);
+            fault = leaf ? leaf_fault(pte, intent) : table_fault(pte, intent);
+            if (fault != NO_FAULT || leaf) {
+                break;
             }
-            else {
-                print_fatal_page_fault(virtual_address, level, page_table);
-                exit(EFAULT);
+            if ((pte & PTE_CUSTOM) != 0) {
+                translation.shared_path = 1;
             }
+            page_table = ppn_to_page(pte_get_ppn(entry));
         }
-        faulted = 0;
-
-        if (level != 0) {
-            page_table = vms_ppn_to_page(vms_pte_get_ppn(entry));
-            continue;
+        if (intent == INTENT_WRITE && read_only) {
+            /* Copying on write would change the checkpoint */
+            print_fatal_page_fault(virtual_address, level, page_table, VMS_FAULT_PROTECTION);
+            exit(EFAULT);
+        }
+        if (fault == NO_FAULT) {
+            /* The caller's lookup hits unless another thread gets in
+               first */
+            translation.entry = entry;
+            translation.level = level;
+            profile_event(VMS_EVENT_WALK, virtual_address, level, MMU_LEVELS - 1);
+            tlb_insert(root_tag, virtual_address, &translation);
+            break;
+        }
+        if (entry == faulting_entry && pte_load(entry) == faulting_pte) {
+            print_fatal_page_fault(virtual_address, level, page_table, fault);
+            exit(EFAULT);
         }
+        faulting_entry = entry;
+        faulting_pte = pte_load(entry);
+        page_fault_handler(virtual_address, level, page_table, fault);
+    }
+
+    mmu_unlock();
+    mmu_lock_shared();
+}
 
-        return entry;
+/* The translation for an access with `intent`, faulting as needed. The
+   lock is dropped while faulting, so the lookup is repeated in case
+   another thread changed the tables in the meantime. */
+static void translate(void* virtual_address,
+                      int intent,
+                      struct translation* translation) {
+    while (lookup(virtual_address, intent, translation) != NO_FAULT
+           || (intent == INTENT_WRITE && read_only)) {
+        resolve_fault(virtual_address, intent);
     }
-    __builtin_unreachable();
+    mark_accessed(translation->entry, intent);
+    profile_event(VMS_EVENT_TRANSLATION, virtual_address, translation->level, 0);
 }
 
-static void* translate_address(void* virtual_address, uint64_t* entry) {
-    void* physical_address = vms_ppn_to_page(vms_pte_get_ppn(entry));
+static void* translate_address(void* virtual_address,
+                               const struct translation* translation) {
+    uint64_t offset_mask = (((uint64_t) 1) << (12 + 9 * translation->level)) - 1;
+    void* physical_address = ppn_to_page(pte_get_ppn(translation->entry));
     physical_address = (void*) (((uint64_t)physical_address)
-                       | (((uint64_t) virtual_address) & 0xFFF));
+                       | (((uint64_t) virtual_address) & offset_mask));
     return physical_address;
 }
 
-static void* get_base_page(uint64_t* entry) {
-    return (void*) (((uint64_t)entry) & ~0xFFF);
+/* Give this address space private copies of any shared page tables on the
+   path to `virtual_address`, so the leaf PTE can be modified */
+static void unshare_path(void* virtual_address) {
+    void* page_table = root_page_table;
+    for (int level = MMU_LEVELS - 1; level > 0; --level) {
+        uint64_t* entry = page_table_entry(page_table, virtual_address, level);
+        if (!pte_valid(entry) || is_leaf(level, entry)) {
+            return;
+        }
+        if (pte_custom(entry)) {
+            page_fault_handler(virtual_address, level, page_table,
+                               VMS_FAULT_SHARED_TABLE);
+        }
+        page_table = ppn_to_page(pte_get_ppn(entry));
+    }
 }
 
 void vms_write(void* virtual_address, int value) {
-    uint64_t* entry = mmu(virtual_address);
-    if (!vms_pte_write(entry)) {
-        void* l0 = get_base_page(entry);
-        page_fault_handler(virtual_address, 0, l0);
-        if (!vms_pte_write(entry)) {
-            print_fatal_page_fault(virtual_address, 0, l0);
-            exit(EFAULT);
+    struct translation translation;
+    mmu_lock_shared();
+    translate(virtual_address, INTENT_WRITE, &translation);
+    int* pointer = translate_address(virtual_address, &translation);
+    *pointer = value;
+    mmu_unlock();
+}
+
+/* Walks without faulting, NULL if `virtual_address` has no valid leaf */
+static uint64_t* lookup_entry(void* virtual_address, int* leaf_level) {
+    void* page_table = root_page_table;
+    for (int level = MMU_LEVELS - 1; level >= 0; --level) {
+        uint64_t* entry = page_table_entry(page_table, virtual_address, level);
+        if (!pte_valid(entry)) {
+            return NULL;
+        }
+        if (is_leaf(level, entry)) {
+            *leaf_level = level;
+            return entry;
         }
+        page_table = ppn_to_page(pte_get_ppn(entry));
     }
-    int* pointer = translate_address(virtual_address, entry);
-    *pointer = value;
+    __builtin_unreachable();
+}
+
+/* The level 0 entry of a page that was evicted to swap, or NULL */
+static uint64_t* lookup_swapped_entry(void* virtual_address) {
+    void* page_table = root_page_table;
+    for (int level = MMU_LEVELS - 1; level > 0; --level) {
+        uint64_t* entry = page_table_entry(page_table, virtual_address, level);
+        if (!pte_valid(entry) || is_leaf(level, entry)) {
+            return NULL;
+        }
+        page_table = ppn_to_page(pte_get_ppn(entry));
+    }
+    uint64_t* entry = page_table_entry(page_table, virtual_address, 0);
+    return pte_swapped(entry) ? entry : NULL;
+}
+
+static void unmap(void* virtual_address) {
+    int level;
+    if (lookup_swapped_entry(virtual_address) != NULL) {
+        unshare_path(virtual_address);
+        uint64_t* entry = lookup_swapped_entry(virtual_address);
+        swap_unref(entry);
+        pte_swapped_clear(entry);
+        *entry = 0;
+        return;
+    }
+    if (lookup_entry(virtual_address, &level) == NULL) {
+        return;
+    }
+
+    unshare_path(virtual_address);
+    uint64_t* entry = lookup_entry(virtual_address, &level);
+    if (level != 0) {
+        /* Only this 4 KiB page goes away, the rest of the huge page stays */
+        split_huge_page(entry);
+        entry = lookup_entry(virtual_address, &level);
+    }
+    mapping_drop_entry(root_page_table, virtual_address, entry);
+    void* page = ppn_to_page(pte_get_ppn(entry));
+    pte_valid_clear(entry);
+    *entry = 0;
+    tlb_flush_page(mmu_tag(), virtual_address);
+    vms_page_unref(page);
+}
+
+void vms_unmap(void* virtual_address) {
+    mmu_lock_exclusive();
+    unmap(virtual_address);
+    mmu_unlock();
 }
 
 int vms_read(void* virtual_address) {
-    uint64_t* entry = mmu(virtual_address);
-    if (!vms_pte_read(entry)) {
-        void* l0 = get_base_page(entry);
-        page_fault_handler(virtual_address, 0, l0);
-        if (!vms_pte_read(entry)) {
-            print_fatal_page_fault(virtual_address, 0, l0);
-            exit(EFAULT);
+    struct translation translation;
+    mmu_lock_shared();
+    translate(virtual_address, INTENT_READ, &translation);
+    int* pointer = translate_address(virtual_address, &translation);
+    int value = *pointer;
+    mmu_unlock();
+    return value;
+}
+
+/* Bytes from `virtual_address` to the end of its page */
+static size_t page_remaining(void* virtual_address) {
+    return PAGE_SIZE - (((uint64_t) virtual_address) & 0xFFF);
+}
+
+static size_t page_preceding(void* virtual_address) {
+    return ((((uint64_t) virtual_address) - 1) & 0xFFF) + 1;
+}
+
+static size_t min_size(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+void vms_read_range(void* virtual_address, void* buffer, size_t length) {
+    uint8_t* source = virtual_address;
+    uint8_t* destination = buffer;
+    mmu_lock_shared();
+    while (length > 0) {
+        size_t chunk = min_size(length, page_remaining(source));
+        struct translation translation;
+        translate(source, INTENT_READ, &translation);
+        memcpy(destination, translate_address(source, &translation), chunk);
+        source += chunk;
+        destination += chunk;
+        length -= chunk;
+    }
+    mmu_unlock();
+}
+
+void vms_write_range(void* virtual_address, const void* buffer, size_t length) {
+    const uint8_t* source = buffer;
+    uint8_t* destination = virtual_address;
+    mmu_lock_shared();
+    while (length > 0) {
+        size_t chunk = min_size(length, page_remaining(destination));
+        struct translation translation;
+        translate(destination, INTENT_WRITE, &translation);
+        memcpy(translate_address(destination, &translation), source, chunk);
+        source += chunk;
+        destination += chunk;
+        length -= chunk;
+    }
+    mmu_unlock();
+}
+
+void vms_memcpy_virtual(void* destination, void* source, size_t length) {
+    uint8_t* to = destination;
+    uint8_t* from = source;
+    /* Like memmove: copy back to front when the destination overlaps the
+       end of the source, so no chunk reads bytes an earlier one wrote */
+    int backwards = to > from && to < from + length;
+    if (backwards) {
+        to += length;
+        from += length;
+    }
+    mmu_lock_shared();
+    while (length > 0) {
+        size_t chunk;
+        if (backwards) {
+            chunk = min_size(length, min_size(page_preceding(to),
+                                              page_preceding(from)));
+            to -= chunk;
+            from -= chunk;
+        } else {
+            chunk = min_size(length, min_size(page_remaining(to),
+                                              page_remaining(from)));
+        }
+        /* Break COW on the destination first, then translate the source
+           in case the fault split a huge page they share. A fault on the
+           source drops the lock and may evict or remap the destination,
+           so translate both again until neither faults. */
+        struct translation to_translation;
+        struct translation from_translation;
+        uint64_t faults;
+        do {
+            faults = faults_taken;
+            translate(to, INTENT_WRITE, &to_translation);
+            translate(from, INTENT_READ, &from_translation);
+        } while (faults_taken != faults);
+        /* Distinct pages may still alias one frame after a merge */
+        memmove(translate_address(to, &to_translation),
+                translate_address(from, &from_translation),
+                chunk);
+        if (!backwards) {
+            to += chunk;
+            from += chunk;
         }
+        length -= chunk;
     }
-    int* pointer = translate_address(virtual_address, entry);
-    return *pointer;
+    mmu_unlock();
 }
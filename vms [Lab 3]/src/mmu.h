@@ -1,8 +1,47 @@
 #ifndef MMU_H
 #define MMU_H
 
+/* Page table depth, set with the meson `levels` option: 3, 4 or 5 levels
+   translate 39, 48 or 57 bit virtual addresses, like RISC-V Sv39, Sv48 and
+   Sv57. Walks are unrolled for it at compile time. */
+#ifndef MMU_LEVELS
+#define MMU_LEVELS 3
+#endif
+#if MMU_LEVELS < 3 || MMU_LEVELS > 5
+#error "MMU_LEVELS must be 3, 4 or 5"
+#endif
+
+#include "vms.h"
+
+#include <stdint.h>
+
+/* A completed walk: the leaf PTE, the level it was found at (0, or 1 for a
+   huge page) and whether the path crossed a copy-on-write page table */
+struct translation {
+    uint64_t* entry;
+    int level;
+    int shared_path;
+};
+
 void page_fault_handler(void* virtual_address,
                         int level,
-                        void* page_table);
+                        void* page_table,
+                        enum vms_fault_reason reason);
+void split_huge_page(uint64_t* entry);
+/* Recompute the TLB tag of the current address space */
+void mmu_update_tag();
+uint64_t mmu_tag();
+/* See mmu.c. Public calls that change page tables take the lock
+   exclusively; page_fault_handler always runs with it held that way. */
+void mmu_lock_shared();
+void mmu_lock_exclusive();
+void mmu_unlock();
+/* Whether this thread holds the lock, either way */
+int mmu_lock_held();
+/* For a helper thread of one holding the lock exclusively, like a fork
+   worker: it counts as holding the lock, and as current in the owner's
+   address space, until mmu_lock_return. It must not translate. */
+void mmu_lock_borrow(void* owner_root_page_table);
+void mmu_lock_return();
 
 #endif
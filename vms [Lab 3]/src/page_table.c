@@ -1,36 +1,39 @@
 #include "vms.h"
 
-#include "pages.h"
-
-#include <assert.h>
-
-#define INDEX_BITS 9
-#define OFFSET_BITS 12
+#include "pte.h"
 
 uint16_t vms_page_table_index(void* virtual_address, int level) {
-    uint8_t start_bit = INDEX_BITS * level + OFFSET_BITS;
-    uint64_t mask = (uint64_t) 0x1FF << start_bit;
-    return (mask & ((uint64_t) virtual_address)) >> start_bit;
+    return page_table_index(virtual_address, level);
 }
 
 uint64_t* vms_page_table_pte_entry_from_index(void* page_table, int index) {
-    return &((uint64_t*) page_table)[index];
+    return page_table_entry_from_index(page_table, index);
 }
 
 uint64_t* vms_page_table_pte_entry(void* page_table,
                                    void* virtual_address,
                                    int level) {
-    uint16_t index = vms_page_table_index(virtual_address, level);
-    return vms_page_table_pte_entry_from_index(page_table, index);
+    return page_table_entry(page_table, virtual_address, level);
+}
+
+int vms_page_table_next_valid(void* page_table, int index) {
+    return page_table_next_valid(page_table, index);
+}
+
+int vms_page_table_valid_count(void* page_table) {
+    uint64_t* words = page_occupancy(page_table);
+    assert(words != NULL);
+    int count = 0;
+    for (int i = 0; i < OCCUPANCY_WORDS; ++i) {
+        count += __builtin_popcountll(words[i]);
+    }
+    return count;
 }
 
 void* vms_ppn_to_page(uint64_t ppn) {
-    return (void*) (ppn << OFFSET_BITS);
+    return ppn_to_page(ppn);
 }
 
 uint64_t vms_page_to_ppn(void* pointer) {
-    check_page_aligned(pointer);
-    uint64_t ppn = (uint64_t) pointer;
-    assert((ppn & 0xF000000000000000) == 0);
-    return ppn >> OFFSET_BITS;
+    return page_to_ppn(pointer);
 }
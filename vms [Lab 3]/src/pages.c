@@ -1,6 +1,9 @@
 #include "vms.h"
 
 #include "pages.h"
+#include "profile.h"
+#include "swap.h"
+#include "tlb.h"
 
 #include <assert.h> // assert
 #include <errno.h> // errno
@@ -12,11 +15,32 @@
 #include <unistd.h> // sysconf
 
 static void* base_pointer = NULL;
-static int allocated[MAX_PAGES] = {0}; /* This can be more space efficient */
+static size_t max_pages = 0;
+/* A set bit is a free page, and a set summary bit is a word in `free_bits`
+   with at least one free page, so both levels are searched with ctz. Both
+   are updated with atomic operations, so pages can be taken and given back
+   from several threads without a lock. A summary bit may briefly be set
+   for an empty word, never clear for a word with a free page. */
+static void* metadata = NULL; //the reservation holding the arrays below
+static size_t metadata_size = 0;
+static uint64_t* free_bits = NULL;
+static uint64_t* free_summary = NULL;
+static size_t bitmap_words = 0;
+static size_t summary_words = 0;
+/* Summary words below this index are unlikely to have a free page */
+static size_t summary_hint = 0;
+/* Number of page table entries (or owners) referencing each page */
+static int* reference_counts = NULL;
+/* Valid or swapped entries of each page used as a page table, one bit per PTE */
+static uint64_t (*occupancy)[OCCUPANCY_WORDS] = NULL;
+/* Software state attached to a page, e.g. the address space of a root */
+static void** private_data = NULL;
+/* Swap slot + 1 still holding an up to date copy of each page, 0 if none */
+static uint64_t* swap_copies = NULL;
 static int used_pages = 0;
 
 void* vms_get_page_pointer(int index) {
-    return ((uint8_t*) base_pointer) + (index * PAGE_SIZE);
+    return ((uint8_t*) base_pointer) + ((size_t) index * PAGE_SIZE);
 }
 
 int vms_get_page_index(void* pointer) {
@@ -27,46 +51,341 @@ void check_page_aligned(void* pointer) {
     assert((uintptr_t) pointer % PAGE_SIZE == 0);
 }
 
-void vms_init() {
+static void metadata_free() {
+    if (metadata != NULL) {
+        munmap(metadata, metadata_size);
+    }
+    metadata = NULL;
+    metadata_size = 0;
+    free_bits = NULL;
+    free_summary = NULL;
+    reference_counts = NULL;
+    occupancy = NULL;
+    private_data = NULL;
+    swap_copies = NULL;
+    bitmap_words = 0;
+    summary_words = 0;
+    used_pages = 0;
+}
+
+/* Offset of an array of `size` bytes placed after `*end`, cache line
+   aligned */
+static size_t metadata_place(size_t* end, size_t size) {
+    size_t offset = (*end + 63) & ~(size_t) 63;
+    *end = offset + size;
+    return offset;
+}
+
+/* Sized for `max_pages`. All the arrays share one reservation made like
+   the pool's, so only the metadata of pages in use is backed and even
+   MAX_POOL_PAGES costs address space rather than memory. The new arrays
+   are only swapped in once the reservation is made; otherwise there is no
+   metadata left at all, so nothing points into freed memory. */
+static int metadata_reset() {
+    size_t new_bitmap_words = (max_pages + 63) / 64;
+    size_t new_summary_words = (new_bitmap_words + 63) / 64;
+    size_t size = 0;
+    size_t free_bits_at = metadata_place(&size, new_bitmap_words * sizeof(uint64_t));
+    size_t free_summary_at = metadata_place(&size, new_summary_words * sizeof(uint64_t));
+    size_t reference_counts_at = metadata_place(&size, max_pages * sizeof(int));
+    size_t occupancy_at = metadata_place(&size, max_pages * sizeof(*occupancy));
+    size_t private_data_at = metadata_place(&size, max_pages * sizeof(void*));
+    size_t swap_copies_at = metadata_place(&size, max_pages * sizeof(uint64_t));
+    uint8_t* reserved = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    metadata_free();
+    if (reserved == MAP_FAILED) {
+        max_pages = 0;
+        return ENOMEM;
+    }
+    metadata = reserved;
+    metadata_size = size;
+    free_bits = (uint64_t*) (reserved + free_bits_at);
+    free_summary = (uint64_t*) (reserved + free_summary_at);
+    reference_counts = (int*) (reserved + reference_counts_at);
+    occupancy = (uint64_t (*)[OCCUPANCY_WORDS]) (reserved + occupancy_at);
+    private_data = (void**) (reserved + private_data_at);
+    swap_copies = (uint64_t*) (reserved + swap_copies_at);
+    bitmap_words = new_bitmap_words;
+    summary_words = new_summary_words;
+
+    memset(free_bits, 0xFF, bitmap_words * sizeof(uint64_t));
+    if (max_pages % 64 != 0) {
+        free_bits[bitmap_words - 1] = ((uint64_t) 1 << (max_pages % 64)) - 1;
+    }
+    for (size_t word = 0; word < bitmap_words; ++word) {
+        free_summary[word / 64] |= (uint64_t) 1 << (word % 64);
+    }
+    summary_hint = 0;
+    used_pages = 0;
+    return 0;
+}
+
+/* `word` ran out of free pages. A page given back concurrently may have
+   set its summary bit already, so check again after clearing it. */
+static void summary_clear(size_t word) {
+    uint64_t bit = (uint64_t) 1 << (word % 64);
+    __atomic_fetch_and(&free_summary[word / 64], ~bit, __ATOMIC_ACQ_REL);
+    if (__atomic_load_n(&free_bits[word], __ATOMIC_ACQUIRE) != 0) {
+        __atomic_fetch_or(&free_summary[word / 64], bit, __ATOMIC_ACQ_REL);
+    }
+}
+
+static int bitmap_take_from(size_t first) {
+    for (size_t i = first; i < summary_words; ++i) {
+        uint64_t summary = __atomic_load_n(&free_summary[i], __ATOMIC_ACQUIRE);
+        while (summary != 0) {
+            size_t word = i * 64 + __builtin_ctzll(summary);
+            uint64_t bits = __atomic_load_n(&free_bits[word], __ATOMIC_ACQUIRE);
+            while (bits != 0) {
+                uint64_t bit = bits & -bits;
+                /* On failure `bits` is reloaded and the lowest bit retried */
+                if (__atomic_compare_exchange_n(&free_bits[word], &bits, bits & ~bit, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    if ((bits & ~bit) == 0) {
+                        summary_clear(word);
+                    }
+                    __atomic_store_n(&summary_hint, i, __ATOMIC_RELAXED);
+                    return word * 64 + __builtin_ctzll(bit);
+                }
+            }
+            summary_clear(word); //taken by other threads meanwhile
+            summary &= summary - 1;
+        }
+    }
+    return -1;
+}
+
+static int bitmap_take() {
+    size_t hint = __atomic_load_n(&summary_hint, __ATOMIC_RELAXED);
+    int index = bitmap_take_from(hint);
+    if (index == -1 && hint != 0) {
+        index = bitmap_take_from(0); //the hint can be stale under contention
+    }
+    return index;
+}
+
+/* Huge pages are taken as 8 whole, aligned bitmap words */
+static int bitmap_take_huge() {
+    int words = NUM_PTE_ENTRIES / 64;
+    for (size_t word = 0; word + words <= bitmap_words; word += words) {
+        int all_free = 1;
+        for (int i = 0; i < words; ++i) {
+            if (__atomic_load_n(&free_bits[word + i], __ATOMIC_ACQUIRE) != ~(uint64_t) 0) {
+                all_free = 0;
+                break;
+            }
+        }
+        if (!all_free) {
+            continue;
+        }
+        int taken = 0;
+        while (taken < words) {
+            uint64_t expected = ~(uint64_t) 0;
+            if (!__atomic_compare_exchange_n(&free_bits[word + taken], &expected, 0, 0,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            ++taken;
+        }
+        if (taken < words) { //another thread took a page, give the words back
+            for (int i = 0; i < taken; ++i) {
+                __atomic_store_n(&free_bits[word + i], ~(uint64_t) 0, __ATOMIC_RELEASE);
+            }
+            continue;
+        }
+        for (int i = 0; i < words; ++i) {
+            summary_clear(word + i);
+        }
+        return word * 64;
+    }
+    return -1;
+}
+
+static int bitmap_allocated(int index) {
+    uint64_t bits = __atomic_load_n(&free_bits[index / 64], __ATOMIC_ACQUIRE);
+    return (bits & ((uint64_t) 1 << (index % 64))) == 0;
+}
+
+static void bitmap_give(int index) {
+    size_t word = index / 64;
+    __atomic_fetch_or(&free_bits[word], (uint64_t) 1 << (index % 64), __ATOMIC_ACQ_REL);
+    __atomic_fetch_or(&free_summary[word / 64], (uint64_t) 1 << (word % 64), __ATOMIC_ACQ_REL);
+    if (word / 64 < __atomic_load_n(&summary_hint, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&summary_hint, word / 64, __ATOMIC_RELAXED);
+    }
+}
+
+int vms_init_pool(size_t pages) {
     assert(sysconf(_SC_PAGE_SIZE) == PAGE_SIZE);
+    if (pages == 0 || pages > MAX_POOL_PAGES) {
+        return EINVAL;
+    }
 
-    base_pointer = mmap(
+    if (base_pointer != NULL) {
+        munmap(base_pointer, max_pages * PAGE_SIZE);
+        base_pointer = NULL;
+        max_pages = 0;
+    }
+
+    /* Only reserve the address range, physical memory is committed by the
+       kernel as pages are first touched */
+    void* pointer = mmap(
         NULL,
-        MAX_PAGES * PAGE_SIZE,
+        pages * PAGE_SIZE,
         PROT_READ | PROT_WRITE,
-        MAP_ANONYMOUS | MAP_SHARED,
+        MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
         -1,
         0
     );
-    if (base_pointer == MAP_FAILED) {
+    if (pointer == MAP_FAILED) {
         int err = errno;
-        perror("mmap");
+        metadata_free(); //it described the pool just unmapped
+        return err;
+    }
+    check_page_aligned(pointer);
+    base_pointer = pointer;
+    max_pages = pages;
+
+    int err = metadata_reset();
+    if (err != 0) {
+        munmap(base_pointer, pages * PAGE_SIZE);
+        base_pointer = NULL;
+        return err;
+    }
+    tlb_flush();
+    return 0;
+}
+
+void vms_init() {
+    int err = vms_init_pool(MAX_PAGES);
+    if (err != 0) {
+        errno = err;
+        perror("vms_init");
         exit(err);
     }
-    check_page_aligned(base_pointer);
+}
+
+size_t vms_get_max_pages() {
+    return max_pages;
+}
+
+static int take_page() {
+    int i = bitmap_take();
+    if (i != -1) {
+        __atomic_add_fetch(&used_pages, 1, __ATOMIC_RELAXED);
+    }
+    return i;
 }
 
 void* vms_new_page() {
-    for (int i = 0; i < MAX_PAGES; ++i) {
-        if (!allocated[i]) {
-            allocated[i] = 1;
-            ++used_pages;
-            return vms_get_page_pointer(i);
-        }
+    int i = take_page();
+    if (i == -1 && swap_reclaim() == 0) {
+        i = take_page(); //a page was evicted to swap
+    }
+    if (i == -1) {
+        errno = ENOMEM;
+        return NULL;
     }
-    exit(ENOMEM);
+    reference_counts[i] = 1;
+    profile_event(VMS_EVENT_ALLOC, vms_get_page_pointer(i), 0, 1);
+    return vms_get_page_pointer(i);
+}
+
+void* vms_new_huge_page() {
+    int first = bitmap_take_huge();
+    if (first != -1) {
+        __atomic_add_fetch(&used_pages, NUM_PTE_ENTRIES, __ATOMIC_RELAXED);
+    }
+    if (first == -1) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* Each 4 KiB page is counted separately so a huge page can be split */
+    for (int i = first; i < first + NUM_PTE_ENTRIES; ++i) {
+        reference_counts[i] = 1;
+    }
+    profile_event(VMS_EVENT_ALLOC, vms_get_page_pointer(first), 0, NUM_PTE_ENTRIES);
+    return vms_get_page_pointer(first);
 }
 
 void vms_free_page(void* pointer) {
     check_page_aligned(pointer);
 
     int i = vms_get_page_index(pointer);
-    assert(allocated[i]);
-    allocated[i] = 0;
+    assert(bitmap_allocated(i));
+    profile_event(VMS_EVENT_FREE, pointer, 0, 1);
+    /* A page table with entries, or a root, may have cached translations
+       pointing into it. Data pages are most of what is freed and have
+       none, the TLB keeps the location of their PTE instead. */
+    int table = private_data[i] != NULL;
+    for (int word = 0; word < OCCUPANCY_WORDS && !table; ++word) {
+        table = occupancy[i][word] != 0;
+    }
+    reference_counts[i] = 0;
+    memset(occupancy[i], 0, sizeof(occupancy[i]));
+    private_data[i] = NULL;
+    if (swap_copies[i] != 0) {
+        swap_drop_copy(pointer);
+    }
     memset(pointer, 0, PAGE_SIZE);
-    --used_pages;
+
+    bitmap_give(i);
+    __atomic_sub_fetch(&used_pages, 1, __ATOMIC_RELAXED);
+    if (table) {
+        tlb_flush();
+    }
+}
+
+void vms_page_ref(void* pointer) {
+    int i = vms_get_page_index(pointer);
+    assert(bitmap_allocated(i));
+    __atomic_add_fetch(&reference_counts[i], 1, __ATOMIC_RELAXED);
+}
+
+void vms_page_unref(void* pointer) {
+    int i = vms_get_page_index(pointer);
+    assert(reference_counts[i] > 0);
+    if (__atomic_sub_fetch(&reference_counts[i], 1, __ATOMIC_ACQ_REL) == 0) {
+        vms_free_page(pointer);
+    }
+}
+
+int vms_page_ref_count(void* pointer) {
+    return reference_counts[vms_get_page_index(pointer)];
+}
+
+void** page_private(void* pointer) {
+    return &private_data[vms_get_page_index(pointer)];
+}
+
+uint64_t* page_swap_copy(void* pointer) {
+    return &swap_copies[vms_get_page_index(pointer)];
+}
+
+uint64_t* page_occupancy(void* pointer) {
+    uint64_t offset = ((uint64_t) pointer) - ((uint64_t) base_pointer);
+    if (base_pointer == NULL || offset >= max_pages * PAGE_SIZE) {
+        return NULL; //not a pool page, so not a page table we track
+    }
+    return occupancy[offset / PAGE_SIZE];
+}
+
+void page_occupancy_update(uint64_t* entry, int valid) {
+    uint64_t* words = page_occupancy(entry);
+    if (words == NULL) {
+        return;
+    }
+    int index = (((uint64_t) entry) & (PAGE_SIZE - 1)) / sizeof(uint64_t);
+    uint64_t bit = (uint64_t) 1 << (index % 64);
+    if (valid) {
+        words[index / 64] |= bit;
+    }
+    else {
+        words[index / 64] &= ~bit;
+    }
 }
 
 int vms_get_used_pages() {
-    return used_pages;
+    return __atomic_load_n(&used_pages, __ATOMIC_RELAXED);
 }
@@ -2,9 +2,22 @@
 #define PAGES_H
 
 #define MAX_PAGES 256
+#define MAX_POOL_PAGES ((size_t) 1 << 28)
 #define NUM_PTE_ENTRIES 512
+#define OCCUPANCY_WORDS (NUM_PTE_ENTRIES / 64)
+
+#include <stdint.h>
 
 void check_page_aligned(void* pointer);
+/* The valid (or swapped) entry bitmap of the pool page containing `pointer`,
+   or NULL if it is outside the pool. Kept up to date by the PTE valid and
+   swapped bit setters. */
+uint64_t* page_occupancy(void* pointer);
+void page_occupancy_update(uint64_t* entry, int valid);
+/* Software state attached to a page, cleared when the page is freed */
+void** page_private(void* pointer);
+/* Swap slot + 1 that holds a clean copy of a resident page, or 0 */
+uint64_t* page_swap_copy(void* pointer);
 
 #endif
 
@@ -0,0 +1,315 @@
+#include "vms.h"
+
+#include "mmu.h"
+#include "pages.h"
+#include "profile.h"
+#include "space.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int profile_flags = 0;
+static uint64_t start_time = 0;
+
+/* The ring holds the last `trace_capacity` events. Writers claim an index
+   with an atomic increment of `trace_next`, which counts every event ever
+   recorded. Each slot is a seqcount: `sequence` is odd while the event
+   with index (sequence - 1) / 2 is written and 2 * index + 2 once it is
+   complete, so readers copy an event out without a lock and drop it if it
+   changed meanwhile. */
+struct trace_slot {
+    uint64_t sequence;
+    struct vms_event event;
+};
+
+static struct trace_slot* trace = NULL;
+static size_t trace_capacity = 0;
+static uint64_t trace_next = 0;
+
+uint64_t profile_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The trace is swapped with the MMU lock held exclusively, so no event is
+   being recorded into the old one. Returns the old trace to free. */
+static struct trace_slot* trace_swap(int flags, struct trace_slot* slots, size_t capacity) {
+    mmu_lock_exclusive();
+    struct trace_slot* old = trace;
+    trace = slots;
+    trace_capacity = capacity;
+    trace_next = 0;
+    start_time = profile_clock();
+    __atomic_store_n(&profile_flags, flags, __ATOMIC_RELEASE);
+    mmu_unlock();
+    return old;
+}
+
+int vms_profile_enable(int flags, size_t trace_events) {
+    if (flags & ~(VMS_PROFILE_COUNTERS | VMS_PROFILE_TRACE)) {
+        return EINVAL;
+    }
+    if ((flags & VMS_PROFILE_TRACE) && trace_events == 0) {
+        return EINVAL;
+    }
+    struct trace_slot* slots = NULL;
+    size_t capacity = 0;
+    if (flags & VMS_PROFILE_TRACE) {
+        slots = calloc(trace_events, sizeof(struct trace_slot));
+        if (slots == NULL) {
+            vms_profile_disable();
+            return ENOMEM;
+        }
+        capacity = trace_events;
+    }
+    free(trace_swap(flags, slots, capacity));
+    return 0;
+}
+
+void vms_profile_disable() {
+    free(trace_swap(0, NULL, 0));
+}
+
+/* The address space whose counters an event goes to. Frees may happen
+   while the current root is being destroyed, so they never create one. */
+static struct address_space* profile_space(void* root_page_table,
+                                           enum vms_event_type type) {
+    if (root_page_table == NULL || vms_page_ref_count(root_page_table) == 0) {
+        return NULL;
+    }
+    if (type == VMS_EVENT_FREE) {
+        return space_get(root_page_table);
+    }
+    return space_get_or_create(root_page_table);
+}
+
+static void add(uint64_t* counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static void count(struct vms_counters* counters,
+                  enum vms_event_type type,
+                  int level,
+                  uint64_t value) {
+    switch (type) {
+    case VMS_EVENT_TRANSLATION:
+        add(&counters->translations, 1);
+        break;
+    case VMS_EVENT_WALK:
+        for (int visited = level; visited <= (int) value; ++visited) {
+            add(&counters->walks[visited], 1);
+        }
+        break;
+    case VMS_EVENT_FAULT:
+        add(&counters->faults, 1);
+        if (value < VMS_FAULT_REASONS) {
+            add(&counters->fault_reasons[value], 1);
+        }
+        break;
+    case VMS_EVENT_COW_FAULT:
+        add(&counters->cow_faults, 1);
+        break;
+    case VMS_EVENT_COPY:
+        add(&counters->copies, 1);
+        add(&counters->copied_bytes, value);
+        break;
+    case VMS_EVENT_ALLOC:
+        add(&counters->allocations, value); //pages
+        break;
+    case VMS_EVENT_FREE:
+        add(&counters->frees, value);
+        break;
+    case VMS_EVENT_FORK:
+        add(&counters->forks, 1);
+        add(&counters->fork_nanoseconds, value);
+        break;
+    default:
+        break;
+    }
+}
+
+/* An event `trace_capacity` or more later may have taken the slot
+   already, then this one is dropped as if it had been overwritten. An
+   earlier one still being written is waited for. */
+static void trace_write(uint64_t index, const struct vms_event* event) {
+    struct trace_slot* slot = &trace[index % trace_capacity];
+    uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (sequence >= 2 * index + 1) {
+            return;
+        }
+        if (sequence % 2 == 0
+            && __atomic_compare_exchange_n(&slot->sequence, &sequence, 2 * index + 1, 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE); //the odd sequence before the fields
+    __atomic_store_n(&slot->event.time, event->time, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->event.space, event->space, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->event.address, event->address, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->event.value, event->value, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->event.type, event->type, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->event.level, event->level, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence, 2 * index + 2, __ATOMIC_RELEASE);
+}
+
+/* Copy out event `index`, 0 if it is not complete or was overwritten */
+static int trace_copy(uint64_t index, struct vms_event* event) {
+    struct trace_slot* slot = &trace[index % trace_capacity];
+    uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    if (sequence != 2 * index + 2) {
+        return 0;
+    }
+    event->time = __atomic_load_n(&slot->event.time, __ATOMIC_RELAXED);
+    event->space = __atomic_load_n(&slot->event.space, __ATOMIC_RELAXED);
+    event->address = __atomic_load_n(&slot->event.address, __ATOMIC_RELAXED);
+    event->value = __atomic_load_n(&slot->event.value, __ATOMIC_RELAXED);
+    event->type = __atomic_load_n(&slot->event.type, __ATOMIC_RELAXED);
+    event->level = __atomic_load_n(&slot->event.level, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); //the fields before the second read
+    return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+void profile_record(enum vms_event_type type,
+                    void* address,
+                    int level,
+                    uint64_t value) {
+    /* Events from outside the MMU lock, like pages the user allocates
+       directly, hold it shared so the trace is not swapped under them */
+    int locked = mmu_lock_held();
+    if (!locked) {
+        mmu_lock_shared();
+    }
+    int flags = __atomic_load_n(&profile_flags, __ATOMIC_ACQUIRE);
+    void* root_page_table = vms_get_root_page_table();
+
+    if (flags & VMS_PROFILE_COUNTERS) {
+        struct address_space* space = profile_space(root_page_table, type);
+        if (space != NULL) {
+            count(&space->counters, type, level, value);
+        }
+    }
+
+    if (flags & VMS_PROFILE_TRACE) {
+        uint64_t index = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+        struct vms_event event = {
+            .time = profile_clock() - start_time,
+            .space = (uint64_t) root_page_table,
+            .address = (uint64_t) address,
+            .value = value,
+            .type = type,
+            .level = level,
+        };
+        trace_write(index, &event);
+    }
+    if (!locked) {
+        mmu_unlock();
+    }
+}
+
+int vms_get_counters(void* root_page_table, struct vms_counters* counters) {
+    if (root_page_table == NULL) {
+        return EINVAL;
+    }
+    check_page_aligned(root_page_table);
+    struct address_space* space = space_get(root_page_table);
+    if (space == NULL) {
+        *counters = (struct vms_counters) {0};
+        return 0;
+    }
+    *counters = space->counters;
+    return 0;
+}
+
+void vms_reset_counters(void* root_page_table) {
+    struct address_space* space = space_get(root_page_table);
+    if (space != NULL) {
+        space->counters = (struct vms_counters) {0};
+    }
+}
+
+/* Copy up to `max` of the most recent complete events, oldest first.
+   `recorded` is set to the number of events ever recorded. */
+static size_t trace_collect(struct vms_event* events, size_t max, uint64_t* recorded) {
+    *recorded = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    uint64_t kept = *recorded < trace_capacity ? *recorded : trace_capacity;
+    if (kept > max) {
+        kept = max;
+    }
+    size_t copied = 0;
+    for (uint64_t index = *recorded - kept; index < *recorded; ++index) {
+        copied += trace_copy(index, &events[copied]);
+    }
+    return copied;
+}
+
+size_t vms_trace_read(struct vms_event* events, size_t max) {
+    /* Shared, so the trace is not swapped meanwhile */
+    int locked = mmu_lock_held();
+    if (!locked) {
+        mmu_lock_shared();
+    }
+    size_t copied = 0;
+    uint64_t recorded;
+    if (trace != NULL) {
+        copied = trace_collect(events, max, &recorded);
+    }
+    if (!locked) {
+        mmu_unlock();
+    }
+    return copied;
+}
+
+int vms_trace_dump(const char* path) {
+    int locked = mmu_lock_held();
+    if (!locked) {
+        mmu_lock_shared();
+    }
+    struct vms_event* events = NULL;
+    size_t kept = 0;
+    uint64_t recorded = 0;
+    int err = trace == NULL ? EINVAL : 0;
+    if (err == 0) {
+        events = malloc(trace_capacity * sizeof(struct vms_event));
+        err = events == NULL ? ENOMEM : 0;
+    }
+    if (err == 0) {
+        kept = trace_collect(events, trace_capacity, &recorded);
+    }
+    if (!locked) {
+        mmu_unlock();
+    }
+    if (err != 0) {
+        return err;
+    }
+
+    struct vms_trace_header header = {
+        .version = 1,
+        .levels = MMU_LEVELS,
+        .events = kept,
+        .dropped = recorded - kept,
+    };
+    memcpy(header.magic, VMS_TRACE_MAGIC, sizeof(header.magic));
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        err = errno;
+        free(events);
+        return err;
+    }
+    if (fwrite(&header, sizeof(header), 1, file) != 1
+        || fwrite(events, sizeof(struct vms_event), kept, file) != kept) {
+        err = EIO;
+    }
+    if (fclose(file) != 0 && err == 0) {
+        err = errno;
+    }
+    free(events);
+    return err;
+}
@@ -0,0 +1,33 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "vms.h"
+
+#include <stdint.h>
+
+/* The VMS_PROFILE_* flags in effect, 0 when profiling is off */
+extern int profile_flags;
+
+void profile_record(enum vms_event_type type,
+                    void* address,
+                    int level,
+                    uint64_t value);
+/* Monotonic nanoseconds */
+uint64_t profile_clock();
+
+/* Hooks on the hot paths cost a load and a predicted branch when
+   profiling is off */
+static inline int profile_enabled() {
+    return __builtin_expect(__atomic_load_n(&profile_flags, __ATOMIC_RELAXED) != 0, 0);
+}
+
+static inline void profile_event(enum vms_event_type type,
+                                 void* address,
+                                 int level,
+                                 uint64_t value) {
+    if (profile_enabled()) {
+        profile_record(type, address, level, value);
+    }
+}
+
+#endif
@@ -1,67 +1,143 @@
 #include "vms.h"
 
-#define PTE_CUSTOM (1 << 8)
-#define PTE_WRITE (1 << 2)
-#define PTE_READ  (1 << 1)
-#define PTE_VALID (1 << 0)
-#define PTE_PPN_START_BIT 10
+#include "pte.h"
+#include "tlb.h"
+
+/* The TLB and walk cache keep translations made through an entry, and
+   only internal changes know which of them are structural. So a direct
+   edit of a valid entry flushes both; an invalid one has nothing cached
+   through it. The accessed and dirty bits are left out, translation does
+   not depend on them. */
+static void pte_edited(uint64_t* entry, uint64_t before) {
+    if ((before & PTE_VALID) != 0 && pte_load(entry) != before) {
+        tlb_flush();
+    }
+}
 
 void vms_pte_valid_clear(uint64_t* entry) {
-    *entry &= ~PTE_VALID;
+    uint64_t before = pte_load(entry);
+    pte_valid_clear(entry);
+    pte_edited(entry, before);
 }
 
 void vms_pte_valid_set(uint64_t* entry) {
-    *entry |= PTE_VALID;
+    pte_valid_set(entry);
 }
 
 int vms_pte_valid(uint64_t* entry) {
-    return (*entry & PTE_VALID) != 0;
+    return pte_valid(entry);
 }
 
 void vms_pte_read_clear(uint64_t* entry) {
-    *entry &= ~PTE_READ;
+    uint64_t before = pte_load(entry);
+    pte_flag_clear(entry, PTE_READ);
+    pte_edited(entry, before);
 }
 
 void vms_pte_read_set(uint64_t* entry) {
-    *entry |= PTE_READ;
+    uint64_t before = pte_load(entry);
+    pte_flag_set(entry, PTE_READ);
+    pte_edited(entry, before);
 }
 
 int vms_pte_read(uint64_t* entry) {
-    return (*entry & PTE_READ) != 0;
+    return pte_read(entry);
 }
 
 void vms_pte_write_clear(uint64_t* entry) {
-    *entry &= ~PTE_WRITE;
+    uint64_t before = pte_load(entry);
+    pte_flag_clear(entry, PTE_WRITE);
+    pte_edited(entry, before);
 }
 
 void vms_pte_write_set(uint64_t* entry) {
-    *entry |= PTE_WRITE;
+    uint64_t before = pte_load(entry);
+    pte_flag_set(entry, PTE_WRITE);
+    pte_edited(entry, before);
 }
 
 int vms_pte_write(uint64_t* entry) {
-    return (*entry & PTE_WRITE) != 0;
+    return pte_write(entry);
 }
 
 void vms_pte_custom_clear(uint64_t* entry) {
-    *entry &= ~PTE_CUSTOM;
+    uint64_t before = pte_load(entry);
+    pte_flag_clear(entry, PTE_CUSTOM);
+    pte_edited(entry, before);
 }
 
 void vms_pte_custom_set(uint64_t* entry) {
-    *entry |= PTE_CUSTOM;
+    uint64_t before = pte_load(entry);
+    pte_flag_set(entry, PTE_CUSTOM);
+    pte_edited(entry, before);
 }
 
 int vms_pte_custom(uint64_t* entry) {
-    return (*entry & PTE_CUSTOM) != 0;
+    return pte_custom(entry);
+}
+
+void vms_pte_huge_clear(uint64_t* entry) {
+    uint64_t before = pte_load(entry);
+    pte_flag_clear(entry, PTE_HUGE);
+    pte_edited(entry, before);
+}
+
+void vms_pte_huge_set(uint64_t* entry) {
+    uint64_t before = pte_load(entry);
+    pte_flag_set(entry, PTE_HUGE);
+    pte_edited(entry, before);
+}
+
+int vms_pte_huge(uint64_t* entry) {
+    return pte_huge(entry);
+}
+
+void vms_pte_accessed_clear(uint64_t* entry) {
+    pte_flag_clear(entry, PTE_ACCESSED);
+}
+
+void vms_pte_accessed_set(uint64_t* entry) {
+    pte_flag_set(entry, PTE_ACCESSED);
+}
+
+int vms_pte_accessed(uint64_t* entry) {
+    return pte_accessed(entry);
+}
+
+void vms_pte_dirty_clear(uint64_t* entry) {
+    pte_flag_clear(entry, PTE_DIRTY);
+}
+
+void vms_pte_dirty_set(uint64_t* entry) {
+    pte_flag_set(entry, PTE_DIRTY);
+}
+
+int vms_pte_dirty(uint64_t* entry) {
+    return pte_dirty(entry);
+}
+
+void vms_pte_swapped_clear(uint64_t* entry) {
+    uint64_t before = pte_load(entry);
+    pte_swapped_clear(entry);
+    pte_edited(entry, before);
+}
+
+void vms_pte_swapped_set(uint64_t* entry) {
+    uint64_t before = pte_load(entry);
+    pte_swapped_set(entry);
+    pte_edited(entry, before);
+}
+
+int vms_pte_swapped(uint64_t* entry) {
+    return pte_swapped(entry);
 }
 
 uint64_t vms_pte_get_ppn(uint64_t* entry) {
-    uint64_t mask = ((((uint64_t)~0) << 20) >> PTE_PPN_START_BIT);
-    return (*entry & mask) >> PTE_PPN_START_BIT;
+    return pte_get_ppn(entry);
 }
 
 void vms_pte_set_ppn(uint64_t* entry, uint64_t ppn) {
-    uint64_t mask = ~((((uint64_t)~0) << 20) >> PTE_PPN_START_BIT);
-    *entry &= mask;
-    ppn = (ppn << 20) >> PTE_PPN_START_BIT;
-    *entry |= ppn;
+    uint64_t before = pte_load(entry);
+    pte_set_ppn(entry, ppn);
+    pte_edited(entry, before);
 }
@@ -0,0 +1,165 @@
+#ifndef PTE_H
+#define PTE_H
+
+#include "pages.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+#define PTE_HUGE (1 << 9)
+#define PTE_CUSTOM (1 << 8)
+#define PTE_DIRTY (1 << 7)
+#define PTE_ACCESSED (1 << 6)
+#define PTE_SHARED (1 << 4)
+#define PTE_SWAPPED (1 << 3)
+#define PTE_WRITE (1 << 2)
+#define PTE_READ  (1 << 1)
+#define PTE_VALID (1 << 0)
+#define PTE_PPN_START_BIT 10
+#define PTE_PPN_MASK ((((uint64_t) ~0) << 20) >> PTE_PPN_START_BIT)
+
+#define INDEX_BITS 9
+#define OFFSET_BITS 12
+
+/* Inline versions of the exported vms_pte_* and vms_page_table_* helpers.
+   The library uses these on its translation, fork and scan paths, where a
+   call per bit test would dominate; pte.c and page_table.c export the
+   vms_* symbols as wrappers around them. */
+
+/* Entries are read and updated atomically: threads translating through a
+   table set accessed and dirty bits while holding the MMU lock shared */
+static inline uint64_t pte_load(uint64_t* entry) {
+    return __atomic_load_n(entry, __ATOMIC_RELAXED);
+}
+
+static inline void pte_flag_set(uint64_t* entry, uint64_t flag) {
+    __atomic_fetch_or(entry, flag, __ATOMIC_RELAXED);
+}
+
+static inline void pte_flag_clear(uint64_t* entry, uint64_t flag) {
+    __atomic_fetch_and(entry, ~flag, __ATOMIC_RELAXED);
+}
+
+static inline int pte_valid(uint64_t* entry) {
+    return (pte_load(entry) & PTE_VALID) != 0;
+}
+
+static inline void pte_valid_set(uint64_t* entry) {
+    pte_flag_set(entry, PTE_VALID);
+    page_occupancy_update(entry, 1);
+}
+
+static inline void pte_valid_clear(uint64_t* entry) {
+    pte_flag_clear(entry, PTE_VALID);
+    page_occupancy_update(entry, 0);
+}
+
+static inline int pte_read(uint64_t* entry) {
+    return (pte_load(entry) & PTE_READ) != 0;
+}
+
+static inline int pte_write(uint64_t* entry) {
+    return (pte_load(entry) & PTE_WRITE) != 0;
+}
+
+static inline int pte_custom(uint64_t* entry) {
+    return (pte_load(entry) & PTE_CUSTOM) != 0;
+}
+
+static inline int pte_huge(uint64_t* entry) {
+    return (pte_load(entry) & PTE_HUGE) != 0;
+}
+
+static inline int pte_accessed(uint64_t* entry) {
+    return (pte_load(entry) & PTE_ACCESSED) != 0;
+}
+
+static inline int pte_dirty(uint64_t* entry) {
+    return (pte_load(entry) & PTE_DIRTY) != 0;
+}
+
+/* A leaf of a VMS_MAP_SHARED mapping: forks keep it writable in both
+   address spaces instead of making it copy-on-write, and it is never
+   evicted or merged */
+static inline int pte_shared(uint64_t* entry) {
+    return (pte_load(entry) & PTE_SHARED) != 0;
+}
+
+/* A swapped entry is not valid, its PPN holds the swap slot instead. It
+   still counts as occupied so table walks visit it. */
+static inline int pte_swapped(uint64_t* entry) {
+    return (pte_load(entry) & PTE_SWAPPED) != 0;
+}
+
+static inline void pte_swapped_set(uint64_t* entry) {
+    pte_flag_set(entry, PTE_SWAPPED);
+    page_occupancy_update(entry, 1);
+}
+
+static inline void pte_swapped_clear(uint64_t* entry) {
+    pte_flag_clear(entry, PTE_SWAPPED);
+    page_occupancy_update(entry, 0);
+}
+
+static inline uint64_t pte_get_ppn(uint64_t* entry) {
+    return (pte_load(entry) & PTE_PPN_MASK) >> PTE_PPN_START_BIT;
+}
+
+static inline void pte_set_ppn(uint64_t* entry, uint64_t ppn) {
+    ppn = (ppn << 20) >> PTE_PPN_START_BIT;
+    /* Other threads may set accessed or dirty bits in the meantime */
+    uint64_t old = pte_load(entry);
+    while (!__atomic_compare_exchange_n(entry, &old, (old & ~PTE_PPN_MASK) | ppn, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline uint16_t page_table_index(void* virtual_address, int level) {
+    return (((uint64_t) virtual_address) >> (INDEX_BITS * level + OFFSET_BITS))
+           & 0x1FF;
+}
+
+static inline uint64_t* page_table_entry_from_index(void* page_table, int index) {
+    return &((uint64_t*) page_table)[index];
+}
+
+static inline uint64_t* page_table_entry(void* page_table,
+                                         void* virtual_address,
+                                         int level) {
+    return page_table_entry_from_index(page_table,
+                                       page_table_index(virtual_address, level));
+}
+
+static inline int page_table_next_valid(void* page_table, int index) {
+    uint64_t* words = page_occupancy(page_table);
+    assert(words != NULL);
+    while (index < NUM_PTE_ENTRIES) {
+        uint64_t bits = words[index / 64] & (~(uint64_t) 0 << (index % 64));
+        if (bits != 0) {
+            return (index & ~63) + __builtin_ctzll(bits);
+        }
+        index = (index & ~63) + 64;
+    }
+    return NUM_PTE_ENTRIES;
+}
+
+/* Copy-on-write shares a whole level 0 table: writable entries of
+   `parent` that are not PTE_SHARED lose W and gain CUSTOM, and `child`
+   gets each resulting entry masked with `child_keep`. See pte_simd.c. */
+void pte_table_share(uint64_t* parent, uint64_t* child, uint64_t child_keep);
+/* Bit i of the OCCUPANCY_WORDS words of `mask` is set if entry i of
+   `table` has all of `bits` set */
+void pte_table_mask(uint64_t* table, uint64_t bits, uint64_t* mask);
+
+static inline void* ppn_to_page(uint64_t ppn) {
+    return (void*) (ppn << OFFSET_BITS);
+}
+
+static inline uint64_t page_to_ppn(void* pointer) {
+    check_page_aligned(pointer);
+    uint64_t ppn = (uint64_t) pointer;
+    assert((ppn & 0xF000000000000000) == 0);
+    return ppn >> OFFSET_BITS;
+}
+
+#endif
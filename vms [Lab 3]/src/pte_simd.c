@@ -0,0 +1,154 @@
+#include "vms.h"
+
+#include "pte.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* Whole table passes over the PTEs, 4 entries at a time with AVX2, 2 with
+   SSE2 (always there on x86-64) or one at a time elsewhere. Tables are
+   only transformed with the MMU lock held exclusively, so plain vector
+   loads and stores do not race with accessed and dirty bit updates. */
+
+_Static_assert(PTE_CUSTOM == PTE_WRITE << 6, "the share kernels move W to CUSTOM with a shift");
+_Static_assert(PTE_SHARED == PTE_WRITE << 2, "the share kernels keep W of shared entries with a shift");
+
+enum simd { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 };
+
+/* The widest kernels the CPU runs, capped by VMS_SIMD=scalar|sse2|avx2 in
+   the environment to exercise the narrower ones */
+static enum simd simd_level() {
+    static int level = -1;
+    if (level == -1) {
+        enum simd best = SIMD_SCALAR;
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        best = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#endif
+        const char* cap = getenv("VMS_SIMD");
+        if (cap != NULL && strcmp(cap, "scalar") == 0) best = SIMD_SCALAR;
+        if (cap != NULL && strcmp(cap, "sse2") == 0 && best > SIMD_SSE2) best = SIMD_SSE2;
+        level = best;
+    }
+    return level;
+}
+
+static void share_scalar(uint64_t* parent, uint64_t* child, uint64_t child_keep) {
+    for (int i = 0; i < NUM_PTE_ENTRIES; ++i) {
+        uint64_t entry = parent[i];
+        uint64_t write = entry & ~(entry >> 2) & PTE_WRITE;
+        entry = (entry & ~write) | (write << 6);
+        parent[i] = entry;
+        child[i] = entry & child_keep;
+    }
+}
+
+static void mask_scalar(uint64_t* table, uint64_t bits, uint64_t* mask) {
+    for (int word = 0; word < OCCUPANCY_WORDS; ++word) {
+        uint64_t result = 0;
+        for (int i = 0; i < 64; ++i) {
+            uint64_t entry = table[word * 64 + i];
+            result |= (uint64_t) ((entry & bits) == bits) << i;
+        }
+        mask[word] = result;
+    }
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static void share_avx2(uint64_t* parent, uint64_t* child, uint64_t child_keep) {
+    const __m256i write = _mm256_set1_epi64x(PTE_WRITE);
+    const __m256i keep = _mm256_set1_epi64x(child_keep);
+    for (int i = 0; i < NUM_PTE_ENTRIES; i += 4) {
+        __m256i entries = _mm256_loadu_si256((__m256i*) (parent + i));
+        __m256i moved = _mm256_andnot_si256(_mm256_srli_epi64(entries, 2),
+                                            _mm256_and_si256(entries, write));
+        __m256i custom = _mm256_slli_epi64(moved, 6);
+        entries = _mm256_or_si256(_mm256_andnot_si256(moved, entries), custom);
+        _mm256_storeu_si256((__m256i*) (parent + i), entries);
+        _mm256_storeu_si256((__m256i*) (child + i), _mm256_and_si256(entries, keep));
+    }
+}
+
+static void share_sse2(uint64_t* parent, uint64_t* child, uint64_t child_keep) {
+    const __m128i write = _mm_set1_epi64x(PTE_WRITE);
+    const __m128i keep = _mm_set1_epi64x(child_keep);
+    for (int i = 0; i < NUM_PTE_ENTRIES; i += 2) {
+        __m128i entries = _mm_loadu_si128((__m128i*) (parent + i));
+        __m128i moved = _mm_andnot_si128(_mm_srli_epi64(entries, 2),
+                                         _mm_and_si128(entries, write));
+        __m128i custom = _mm_slli_epi64(moved, 6);
+        entries = _mm_or_si128(_mm_andnot_si128(moved, entries), custom);
+        _mm_storeu_si128((__m128i*) (parent + i), entries);
+        _mm_storeu_si128((__m128i*) (child + i), _mm_and_si128(entries, keep));
+    }
+}
+
+/* Entries match when (entry & bits) ^ bits is zero */
+__attribute__((target("avx2")))
+static void mask_avx2(uint64_t* table, uint64_t bits, uint64_t* mask) {
+    const __m256i wanted = _mm256_set1_epi64x(bits);
+    for (int word = 0; word < OCCUPANCY_WORDS; ++word) {
+        uint64_t result = 0;
+        for (int i = 0; i < 64; i += 4) {
+            __m256i entries = _mm256_loadu_si256((__m256i*) (table + word * 64 + i));
+            __m256i match = _mm256_cmpeq_epi64(_mm256_and_si256(entries, wanted), wanted);
+            result |= (uint64_t) _mm256_movemask_pd(_mm256_castsi256_pd(match)) << i;
+        }
+        mask[word] = result;
+    }
+}
+
+static void mask_sse2(uint64_t* table, uint64_t bits, uint64_t* mask) {
+    const __m128i wanted = _mm_set1_epi64x(bits);
+    const __m128i zero = _mm_setzero_si128();
+    for (int word = 0; word < OCCUPANCY_WORDS; ++word) {
+        uint64_t result = 0;
+        for (int i = 0; i < 64; i += 2) {
+            __m128i entries = _mm_loadu_si128((__m128i*) (table + word * 64 + i));
+            __m128i missing = _mm_xor_si128(_mm_and_si128(entries, wanted), wanted);
+            /* No 64 bit compare in SSE2: both 32 bit halves must be zero */
+            int halves = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(missing, zero)));
+            result |= (uint64_t) ((halves & 0x3) == 0x3) << i;
+            result |= (uint64_t) ((halves & 0xC) == 0xC) << (i + 1);
+        }
+        mask[word] = result;
+    }
+}
+
+#endif
+
+void pte_table_share(uint64_t* parent, uint64_t* child, uint64_t child_keep) {
+    switch (simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX2:
+        share_avx2(parent, child, child_keep);
+        break;
+    case SIMD_SSE2:
+        share_sse2(parent, child, child_keep);
+        break;
+#endif
+    default:
+        share_scalar(parent, child, child_keep);
+    }
+}
+
+void pte_table_mask(uint64_t* table, uint64_t bits, uint64_t* mask) {
+    switch (simd_level()) {
+#if defined(__x86_64__)
+    case SIMD_AVX2:
+        mask_avx2(table, bits, mask);
+        break;
+    case SIMD_SSE2:
+        mask_sse2(table, bits, mask);
+        break;
+#endif
+    default:
+        mask_scalar(table, bits, mask);
+    }
+}
@@ -0,0 +1,281 @@
+#include "vms.h"
+
+#include "mapping.h"
+#include "mmu.h"
+#include "pages.h"
+#include "space.h"
+#include "tlb.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* ASIDs are handed out from 1, 0 means none. They stay below PAGE_SIZE so
+   they can share the TLB tag space with root page table addresses. */
+#define MAX_ASIDS 4096
+
+static void* asid_roots[MAX_ASIDS];
+static int asid_hint = 1;
+/* Bumped whenever an ASID is assigned or released, with the MMU lock held
+   exclusively, so threads notice their cached tag may be out of date */
+static uint64_t asid_generation = 0;
+static uint64_t next_id = 1;
+
+struct address_space* space_get(void* root_page_table) {
+    return *page_private(root_page_table);
+}
+
+struct address_space* space_get_or_create(void* root_page_table) {
+    void** private = page_private(root_page_table);
+    if (__atomic_load_n(private, __ATOMIC_ACQUIRE) == NULL) {
+        /* Profiling creates it from translations, which run concurrently */
+        struct address_space* space = calloc(1, sizeof(struct address_space));
+        if (space != NULL) {
+            space->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+        }
+        void* expected = NULL;
+        if (space != NULL
+            && !__atomic_compare_exchange_n(private, &expected, space, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+            free(space);
+        }
+    }
+    return __atomic_load_n(private, __ATOMIC_ACQUIRE);
+}
+
+struct region* space_find_region(void* root_page_table, void* virtual_address) {
+    struct address_space* space = space_get(root_page_table);
+    if (space == NULL) {
+        return NULL;
+    }
+    uint64_t address = (uint64_t) virtual_address;
+    for (struct region* region = space->regions;
+         region != NULL;
+         region = region->next) {
+        if (address >= region->start && address < region->end) {
+            return region;
+        }
+    }
+    return NULL;
+}
+
+static struct shared_pages* shared_pages_create(size_t count) {
+    struct shared_pages* shared = calloc(1, sizeof(struct shared_pages) + count * sizeof(struct shared_page));
+    if (shared == NULL) {
+        return NULL;
+    }
+    shared->count = count;
+    return shared;
+}
+
+static void shared_pages_unref(struct shared_pages* shared) {
+    if (--shared->references != 0) {
+        return;
+    }
+    for (size_t i = 0; i < shared->count; ++i) {
+        if (shared->pages[i].page != NULL) {
+            vms_page_unref(shared->pages[i].page);
+        }
+    }
+    free(shared);
+}
+
+int space_add_region(void* root_page_table, const struct region* source) {
+    struct address_space* space = space_get_or_create(root_page_table);
+    if (space == NULL) {
+        return ENOMEM;
+    }
+    for (struct region* region = space->regions;
+         region != NULL;
+         region = region->next) {
+        if (source->start < region->end && region->start < source->end) {
+            return EEXIST;
+        }
+    }
+
+    struct region* region = malloc(sizeof(struct region));
+    if (region == NULL) {
+        return ENOMEM;
+    }
+    *region = *source;
+    if (source->fd != -1) {
+        region->fd = dup(source->fd);
+        if (region->fd == -1) {
+            int err = errno;
+            free(region);
+            return err;
+        }
+    }
+    if (region->flags & VMS_MAP_SHARED) {
+        if (region->shared == NULL) {
+            region->shared = shared_pages_create((region->end - region->start) / PAGE_SIZE);
+        }
+        if (region->shared == NULL) {
+            if (region->fd != -1) {
+                close(region->fd);
+            }
+            free(region);
+            return ENOMEM;
+        }
+        ++region->shared->references;
+    }
+    region->next = space->regions;
+    space->regions = region;
+    return 0;
+}
+
+int space_fork(void* parent_root_page_table, void* child_root_page_table) {
+    struct address_space* parent = space_get(parent_root_page_table);
+    if (parent == NULL) {
+        return 0;
+    }
+    for (struct region* region = parent->regions;
+         region != NULL;
+         region = region->next) {
+        int err = space_add_region(child_root_page_table, region);
+        if (err != 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+static void free_regions(struct address_space* space) {
+    struct region* region = space->regions;
+    while (region != NULL) {
+        struct region* next = region->next;
+        mapping_release_region(region);
+        if (region->fd != -1) {
+            close(region->fd);
+        }
+        if (region->shared != NULL) {
+            shared_pages_unref(region->shared);
+        }
+        free(region);
+        region = next;
+    }
+    space->regions = NULL;
+}
+
+int space_replace_regions(void* root_page_table, void* source_root_page_table) {
+    struct address_space* space = space_get(root_page_table);
+    if (space != NULL) {
+        free_regions(space);
+    }
+    return space_fork(source_root_page_table, root_page_table);
+}
+
+static int asid_in_use(int asid) {
+    return asid > 0 && asid < MAX_ASIDS && asid_roots[asid] != NULL;
+}
+
+/* With the MMU lock held exclusively */
+static void asid_release(int asid) {
+    void* root_page_table = asid_roots[asid];
+    asid_roots[asid] = NULL;
+    space_get(root_page_table)->asid = 0;
+    /* The ASID may be handed out again, so nothing tagged with it may
+       remain */
+    tlb_flush_tag(asid);
+    __atomic_add_fetch(&asid_generation, 1, __ATOMIC_RELEASE);
+}
+
+void space_destroy(void* root_page_table) {
+    void** private = page_private(root_page_table);
+    struct address_space* space = *private;
+    if (space == NULL) {
+        return;
+    }
+    if (space->asid != 0) {
+        asid_release(space->asid);
+    }
+    free_regions(space);
+    free(space);
+    *private = NULL;
+}
+
+int space_asid(void* root_page_table) {
+    struct address_space* space = space_get(root_page_table);
+    if (space == NULL) {
+        return 0;
+    }
+    return space->asid;
+}
+
+uint64_t space_asid_generation() {
+    return __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE);
+}
+
+static int asid_assign(void* root_page_table) {
+    struct address_space* space = space_get_or_create(root_page_table);
+    if (space == NULL) {
+        errno = ENOMEM;
+        return 0;
+    }
+    if (space->asid != 0) {
+        return space->asid;
+    }
+
+    for (int n = 0; n < MAX_ASIDS - 1; ++n) {
+        int asid = (asid_hint - 1 + n) % (MAX_ASIDS - 1) + 1;
+        if (asid_roots[asid] != NULL) {
+            continue;
+        }
+        asid_roots[asid] = root_page_table;
+        asid_hint = asid % (MAX_ASIDS - 1) + 1;
+        space->asid = asid;
+        __atomic_add_fetch(&asid_generation, 1, __ATOMIC_RELEASE);
+        return asid;
+    }
+    errno = EAGAIN;
+    return 0;
+}
+
+int vms_asid_create(void* root_page_table) {
+    check_page_aligned(root_page_table);
+    mmu_lock_exclusive();
+    int asid = asid_assign(root_page_table);
+    mmu_unlock();
+    return asid;
+}
+
+int vms_asid_release(int asid) {
+    mmu_lock_exclusive();
+    if (!asid_in_use(asid)) {
+        mmu_unlock();
+        return EINVAL;
+    }
+    asid_release(asid);
+    mmu_unlock();
+    return 0;
+}
+
+int vms_switch(int asid) {
+    if (!asid_in_use(asid)) {
+        return EINVAL;
+    }
+    vms_set_root_page_table(asid_roots[asid]);
+    return 0;
+}
+
+int vms_get_asid() {
+    void* root_page_table = vms_get_root_page_table();
+    if (root_page_table == NULL) {
+        return 0;
+    }
+    return space_asid(root_page_table);
+}
+
+void* vms_asid_root_page_table(int asid) {
+    if (!asid_in_use(asid)) {
+        return NULL;
+    }
+    return asid_roots[asid];
+}
+
+void vms_tlb_flush_asid(int asid) {
+    if (asid_in_use(asid)) {
+        tlb_flush_tag(asid);
+    }
+}
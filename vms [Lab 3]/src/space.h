@@ -0,0 +1,68 @@
+#ifndef SPACE_H
+#define SPACE_H
+
+#include "vms.h"
+
+#include <stdint.h>
+
+/* The pages of a VMS_MAP_SHARED mapping, referenced by every region
+   forks copied it to. Like a shared memory segment or the page cache of a
+   file, a page stays while any address space maps the region, so a page
+   first touched after a fork is still shared. */
+struct shared_page {
+    void* page; //NULL until first touched, holding a reference
+    /* Written since the file last got it, as seen from the dirty bit of an
+       entry mapping it when that entry was synced or went away. Entries
+       that stay dirty are seen later, at the latest when their address
+       space is destroyed. */
+    int dirty;
+};
+
+struct shared_pages {
+    int references;
+    size_t count;
+    struct shared_page pages[];
+};
+
+/* A range of virtual addresses mapped with vms_map_range or
+   vms_map_file, populated on first touch */
+struct region {
+    uint64_t start;
+    uint64_t end;
+    int prot;
+    int flags;
+    int fd; //-1 for anonymous memory
+    uint64_t offset; //file offset of `start`
+    struct shared_pages* shared; //NULL unless VMS_MAP_SHARED
+    struct region* next;
+};
+
+/* Software state of an address space, found from its root page table */
+struct address_space {
+    struct region* regions;
+    int asid; //0 if none was assigned
+    struct vms_counters counters;
+    uint64_t id; //never reused, unlike the root page table
+    /* For a snapshot, the address space it was taken of */
+    void* snapshot_of;
+    uint64_t snapshot_of_id;
+};
+
+struct address_space* space_get(void* root_page_table);
+struct address_space* space_get_or_create(void* root_page_table);
+struct region* space_find_region(void* root_page_table, void* virtual_address);
+/* Add a copy of `region`, whose `next` is ignored. The copy has its own
+   duplicate of the file descriptor and a new reference to the shared
+   pages, which are created if `region` has none yet. */
+int space_add_region(void* root_page_table, const struct region* region);
+int space_fork(void* parent_root_page_table, void* child_root_page_table);
+/* Replace the regions of `root_page_table` with copies of those of
+   `source_root_page_table` */
+int space_replace_regions(void* root_page_table, void* source_root_page_table);
+void space_destroy(void* root_page_table);
+/* The ASID of the address space rooted at `root_page_table`, or 0 */
+int space_asid(void* root_page_table);
+/* Changes whenever any ASID is assigned or released */
+uint64_t space_asid_generation();
+
+#endif
@@ -0,0 +1,244 @@
+#include "vms.h"
+
+#include "mmu.h"
+#include "pages.h"
+#include "pte.h"
+#include "swap.h"
+#include "tlb.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static int swap_fd = -1;
+static size_t swap_slots = 0;
+/* Number of swapped entries (and resident clean copies) referencing each
+   slot, 0 if the slot is free */
+static int* slot_references = NULL;
+/* Stack of free slots */
+static uint64_t* free_slots = NULL;
+static size_t free_count = 0;
+/* Virtual address the CLOCK hand points at in the current address space */
+static uint64_t clock_hand = 0;
+static struct vms_swap_stats stats;
+
+int vms_swap_enable(const char* path, size_t slots) {
+    if (swap_fd != -1) {
+        return EBUSY;
+    }
+    if (slots == 0) {
+        return EINVAL;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return errno;
+    }
+    slot_references = calloc(slots, sizeof(int));
+    free_slots = malloc(slots * sizeof(uint64_t));
+    if (slot_references == NULL || free_slots == NULL) {
+        free(slot_references);
+        free(free_slots);
+        close(fd);
+        return ENOMEM;
+    }
+    /* Hand out low slots first so the file only grows as needed */
+    for (size_t i = 0; i < slots; ++i) {
+        free_slots[i] = slots - 1 - i;
+    }
+    free_count = slots;
+    swap_slots = slots;
+    swap_fd = fd;
+    clock_hand = 0;
+    return 0;
+}
+
+int vms_swap_disable() {
+    if (swap_fd == -1) {
+        return 0;
+    }
+    if (free_count != swap_slots) {
+        return EBUSY; //some entries still live in the swap file
+    }
+    close(swap_fd);
+    free(slot_references);
+    free(free_slots);
+    swap_fd = -1;
+    swap_slots = 0;
+    slot_references = NULL;
+    free_slots = NULL;
+    free_count = 0;
+    return 0;
+}
+
+int swap_enabled() {
+    return swap_fd != -1;
+}
+
+void vms_swap_get_stats(struct vms_swap_stats* result) {
+    *result = stats;
+}
+
+void vms_swap_reset_stats() {
+    stats = (struct vms_swap_stats) {0};
+}
+
+void swap_count_fault() {
+    ++stats.faults;
+}
+
+static void swap_io_failed(const char* operation) {
+    perror(operation);
+    exit(EIO);
+}
+
+void swap_read(uint64_t* entry, void* page) {
+    off_t offset = (off_t) pte_get_ppn(entry) * PAGE_SIZE;
+    if (pread(swap_fd, page, PAGE_SIZE, offset) != PAGE_SIZE) {
+        swap_io_failed("swap_read");
+    }
+    ++stats.swap_reads;
+}
+
+void swap_ref(uint64_t* entry) {
+    ++slot_references[pte_get_ppn(entry)];
+}
+
+void swap_unref(uint64_t* entry) {
+    uint64_t slot = pte_get_ppn(entry);
+    if (--slot_references[slot] == 0) {
+        free_slots[free_count++] = slot;
+    }
+}
+
+void swap_drop_copy(void* page) {
+    uint64_t* copy = page_swap_copy(page);
+    uint64_t slot = *copy - 1;
+    *copy = 0;
+    if (--slot_references[slot] == 0) {
+        free_slots[free_count++] = slot;
+    }
+}
+
+void swap_in(uint64_t* entry) {
+    void* page = vms_new_page(); //may evict another page, never this one
+    if (page == NULL) exit(ENOMEM); //out of memory while handling the fault
+    swap_read(entry, page);
+    /* Keep the slot: until the page is written, evicting it again needs no
+       I/O */
+    *page_swap_copy(page) = pte_get_ppn(entry) + 1;
+
+    pte_swapped_clear(entry);
+    pte_set_ppn(entry, page_to_ppn(page));
+    pte_valid_set(entry);
+    pte_flag_set(entry, PTE_ACCESSED);
+    pte_flag_clear(entry, PTE_DIRTY);
+    ++stats.major_faults;
+}
+
+/* The first resident 4 KiB leaf at or after `*address` that only the
+   current address space maps: every table on the path and the page itself
+   have a single reference. Huge pages are never evicted. */
+static uint64_t* next_private_leaf(void* page_table,
+                                   int level,
+                                   uint64_t base,
+                                   uint64_t* address) {
+    int shift = 12 + 9 * level;
+    int first = 0;
+    if (*address > base) {
+        first = (*address >> shift) & 0x1FF;
+    }
+    for (int i = page_table_next_valid(page_table, first); i < NUM_PTE_ENTRIES; i = page_table_next_valid(page_table, i + 1)) {
+        uint64_t* entry = page_table_entry_from_index(page_table, i);
+        uint64_t entry_base = base | ((uint64_t) i << shift);
+        if (!pte_valid(entry)) {
+            continue; //already swapped
+        }
+        void* page = ppn_to_page(pte_get_ppn(entry));
+        if (vms_page_ref_count(page) != 1) {
+            continue;
+        }
+        if (level == 0) {
+            *address = entry_base;
+            return entry;
+        }
+        if (pte_huge(entry) || pte_custom(entry)) {
+            continue;
+        }
+        uint64_t* found = next_private_leaf(page, level - 1, entry_base, address);
+        if (found != NULL) {
+            return found;
+        }
+    }
+    return NULL;
+}
+
+/* Clean pages go back to the slot they were read from without a write.
+   Dirty ones overwrite it only if no other entry still refers to it. */
+static int evict(uint64_t* entry, uint64_t address) {
+    void* page = ppn_to_page(pte_get_ppn(entry));
+    uint64_t* copy = page_swap_copy(page);
+    uint64_t slot = *copy - 1;
+    if (*copy != 0 && pte_dirty(entry) && slot_references[slot] > 1) {
+        swap_drop_copy(page); //the other entries keep the old contents
+    }
+    if (*copy == 0) {
+        if (free_count == 0) {
+            return ENOMEM;
+        }
+        slot = free_slots[--free_count];
+        slot_references[slot] = 1;
+    }
+    if (*copy == 0 || pte_dirty(entry)) {
+        if (pwrite(swap_fd, page, PAGE_SIZE, (off_t) slot * PAGE_SIZE) != PAGE_SIZE) {
+            swap_io_failed("swap_write");
+        }
+        ++stats.swap_writes;
+    }
+    *copy = 0; //the entry takes over the slot reference
+
+    /* R, W and custom stay so the page comes back with the same rights */
+    pte_valid_clear(entry);
+    pte_flag_clear(entry, PTE_DIRTY);
+    pte_set_ppn(entry, slot);
+    pte_swapped_set(entry);
+    tlb_flush_page(mmu_tag(), (void*) address);
+    vms_page_unref(page);
+    ++stats.evictions;
+    return 0;
+}
+
+int swap_reclaim() {
+    void* root_page_table = vms_get_root_page_table();
+    if (swap_fd == -1 || root_page_table == NULL) {
+        return ENOMEM;
+    }
+
+    /* Two full sweeps at most: the first may only clear accessed bits */
+    uint64_t limit = (uint64_t) 1 << (12 + 9 * MMU_LEVELS);
+    uint64_t address = clock_hand;
+    int wraps = 0;
+    while (wraps < 3) {
+        uint64_t* entry = NULL;
+        if (address < limit) {
+            entry = next_private_leaf(root_page_table,
+                                      MMU_LEVELS - 1,
+                                      0,
+                                      &address);
+        }
+        if (entry == NULL) {
+            address = 0;
+            ++wraps;
+            continue;
+        }
+        if (pte_accessed(entry)) {
+            pte_flag_clear(entry, PTE_ACCESSED); //second chance
+            address += PAGE_SIZE;
+            continue;
+        }
+        clock_hand = address + PAGE_SIZE;
+        return evict(entry, address);
+    }
+    return ENOMEM;
+}
@@ -0,0 +1,24 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdint.h>
+
+/* Evicts one resident page of the current address space to the swap file,
+   chosen with the CLOCK algorithm over the PTE accessed bits. Returns 0 if
+   a pool page was freed, ENOMEM if swap is disabled or nothing could be
+   evicted. */
+int swap_reclaim();
+int swap_enabled();
+/* Brings the page behind a swapped `entry` back into the pool */
+void swap_in(uint64_t* entry);
+/* Read a swapped page into `page`, without changing its entry */
+void swap_read(uint64_t* entry, void* page);
+/* Another entry refers to the same swap slot as `entry` (a COW fork) */
+void swap_ref(uint64_t* entry);
+/* An entry referring to the swap slot went away */
+void swap_unref(uint64_t* entry);
+/* A page with a clean copy in swap is being freed, release the copy */
+void swap_drop_copy(void* page);
+void swap_count_fault();
+
+#endif
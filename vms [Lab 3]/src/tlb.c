@@ -0,0 +1,197 @@
+#include "vms.h"
+
+#include "tlb.h"
+
+#include <stddef.h>
+
+struct tlb_entry {
+    uint64_t stamp;
+    uint64_t tag;
+    uint64_t vpn;
+    struct translation translation;
+};
+
+struct tlb_set {
+    struct tlb_entry ways[TLB_WAYS];
+    unsigned next_victim;
+};
+
+struct walk_cache_entry {
+    uint64_t stamp;
+    uint64_t tag;
+    uint64_t region;
+    void* page_table;
+    int shared_path;
+};
+
+struct walk_cache_set {
+    struct walk_cache_entry ways[WALK_CACHE_WAYS];
+    unsigned next_victim;
+};
+
+/* Each thread has its own TLB, like each CPU */
+static _Thread_local struct tlb_set sets[TLB_SETS];
+static _Thread_local uint64_t hits = 0;
+static _Thread_local uint64_t misses = 0;
+static _Thread_local struct walk_cache_set walk_sets[WALK_CACHE_SETS];
+static _Thread_local uint64_t walk_hits = 0;
+static _Thread_local uint64_t walk_misses = 0;
+
+/* Entries are stamped with the epoch they were inserted in. A flush starts
+   a new epoch and invalidates everything stamped before it, in every
+   thread's TLB, so a full flush (or a flush of one tag) is O(1) and needs
+   no interrupts. Tags are grouped by set index for the per-tag floor. */
+static uint64_t epoch = 1;
+static uint64_t flushed_before = 1;
+static uint64_t tag_flushed_before[TLB_SETS];
+
+static uint64_t tlb_vpn(void* virtual_address) {
+    return ((uint64_t) virtual_address) >> 12;
+}
+
+static struct tlb_set* tlb_set_for(uint64_t tag, uint64_t vpn) {
+    return &sets[(vpn ^ tag ^ (tag >> 12)) % TLB_SETS];
+}
+
+static uint64_t tlb_floor(uint64_t tag) {
+    uint64_t all = __atomic_load_n(&flushed_before, __ATOMIC_ACQUIRE);
+    uint64_t one = __atomic_load_n(&tag_flushed_before[tag % TLB_SETS], __ATOMIC_ACQUIRE);
+    return all > one ? all : one;
+}
+
+static struct tlb_entry* tlb_find(uint64_t tag, uint64_t vpn) {
+    struct tlb_set* set = tlb_set_for(tag, vpn);
+    uint64_t floor = tlb_floor(tag);
+    for (int i = 0; i < TLB_WAYS; ++i) {
+        struct tlb_entry* way = &set->ways[i];
+        if (way->stamp >= floor
+            && way->vpn == vpn
+            && way->tag == tag) {
+            return way;
+        }
+    }
+    return NULL;
+}
+
+int tlb_lookup(uint64_t tag,
+               void* virtual_address,
+               struct translation* translation) {
+    struct tlb_entry* way = tlb_find(tag,
+                                     tlb_vpn(virtual_address));
+    if (way == NULL) {
+        ++misses;
+        return 0;
+    }
+    ++hits;
+    *translation = way->translation;
+    return 1;
+}
+
+void tlb_insert(uint64_t tag,
+                void* virtual_address,
+                const struct translation* translation) {
+    uint64_t vpn = tlb_vpn(virtual_address);
+    struct tlb_entry* way = tlb_find(tag, vpn);
+    if (way == NULL) {
+        struct tlb_set* set = tlb_set_for(tag, vpn);
+        way = &set->ways[set->next_victim];
+        set->next_victim = (set->next_victim + 1) % TLB_WAYS;
+    }
+    way->stamp = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+    way->tag = tag;
+    way->vpn = vpn;
+    way->translation = *translation;
+}
+
+static uint64_t walk_cache_region(void* virtual_address) {
+    return ((uint64_t) virtual_address) >> 21;
+}
+
+static struct walk_cache_set* walk_cache_set_for(uint64_t tag, uint64_t region) {
+    return &walk_sets[(region ^ tag ^ (tag >> 12)) % WALK_CACHE_SETS];
+}
+
+static struct walk_cache_entry* walk_cache_find(uint64_t tag, uint64_t region) {
+    struct walk_cache_set* set = walk_cache_set_for(tag, region);
+    uint64_t floor = tlb_floor(tag);
+    for (int i = 0; i < WALK_CACHE_WAYS; ++i) {
+        struct walk_cache_entry* way = &set->ways[i];
+        if (way->stamp >= floor
+            && way->region == region
+            && way->tag == tag) {
+            return way;
+        }
+    }
+    return NULL;
+}
+
+int tlb_walk_cache_lookup(uint64_t tag,
+                          void* virtual_address,
+                          void** page_table,
+                          int* shared_path) {
+    struct walk_cache_entry* way = walk_cache_find(tag,
+                                                   walk_cache_region(virtual_address));
+    if (way == NULL) {
+        ++walk_misses;
+        return 0;
+    }
+    ++walk_hits;
+    *page_table = way->page_table;
+    *shared_path = way->shared_path;
+    return 1;
+}
+
+void tlb_walk_cache_insert(uint64_t tag,
+                           void* virtual_address,
+                           void* page_table,
+                           int shared_path) {
+    uint64_t region = walk_cache_region(virtual_address);
+    struct walk_cache_entry* way = walk_cache_find(tag, region);
+    if (way == NULL) {
+        struct walk_cache_set* set = walk_cache_set_for(tag, region);
+        way = &set->ways[set->next_victim];
+        set->next_victim = (set->next_victim + 1) % WALK_CACHE_WAYS;
+    }
+    way->stamp = __atomic_load_n(&epoch, __ATOMIC_ACQUIRE);
+    way->tag = tag;
+    way->region = region;
+    way->page_table = page_table;
+    way->shared_path = shared_path;
+}
+
+void tlb_flush_page(uint64_t tag, void* virtual_address) {
+    struct tlb_entry* way = tlb_find(tag,
+                                     tlb_vpn(virtual_address));
+    if (way != NULL) {
+        way->stamp = 0;
+    }
+}
+
+void tlb_flush_tag(uint64_t tag) {
+    uint64_t next = __atomic_add_fetch(&epoch, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&tag_flushed_before[tag % TLB_SETS], next, __ATOMIC_RELEASE);
+}
+
+void tlb_flush() {
+    uint64_t next = __atomic_add_fetch(&epoch, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&flushed_before, next, __ATOMIC_RELEASE);
+}
+
+void vms_tlb_flush() {
+    tlb_flush();
+}
+
+/* Statistics of the calling thread's TLB */
+void vms_tlb_get_stats(struct vms_tlb_stats* stats) {
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->walk_cache_hits = walk_hits;
+    stats->walk_cache_misses = walk_misses;
+}
+
+void vms_tlb_reset_stats() {
+    hits = 0;
+    misses = 0;
+    walk_hits = 0;
+    walk_misses = 0;
+}
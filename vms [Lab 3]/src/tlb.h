@@ -0,0 +1,45 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include "mmu.h"
+
+#include <stdint.h>
+
+#define TLB_SETS 64
+#define TLB_WAYS 4
+#define WALK_CACHE_SETS 16
+#define WALK_CACHE_WAYS 2
+
+/* The TLB caches the location of the leaf PTE for a (tag, virtual page)
+   pair, not a copy of it. Permission changes and COW remaps made in place
+   are seen on the next access, so only structural changes (a page table
+   page being freed, replaced, split or shared) need a flush.
+
+   The tag is the ASID of the address space, or the address of its root
+   page table if it has none. ASIDs are below PAGE_SIZE, so the two never
+   collide. */
+int tlb_lookup(uint64_t tag,
+               void* virtual_address,
+               struct translation* translation);
+void tlb_insert(uint64_t tag,
+                void* virtual_address,
+                const struct translation* translation);
+/* The walk cache maps the 2 MiB region of `virtual_address` to its level
+   0 table, so a TLB miss in a region walked before reads one entry
+   instead of one per level. It is flushed with the TLB: every change that
+   frees, replaces or shares a page table flushes both. */
+int tlb_walk_cache_lookup(uint64_t tag,
+                          void* virtual_address,
+                          void** page_table,
+                          int* shared_path);
+void tlb_walk_cache_insert(uint64_t tag,
+                           void* virtual_address,
+                           void* page_table,
+                           int shared_path);
+/* Only the calling thread's entry is dropped. Entries in other threads
+   still point at the same PTE, whose new contents they check on a hit. */
+void tlb_flush_page(uint64_t tag, void* virtual_address);
+void tlb_flush_tag(uint64_t tag);
+void tlb_flush();
+
+#endif
@@ -1,167 +1,777 @@
 #include "vms.h"
 
+#include "mapping.h"
 #include "mmu.h"
 #include "pages.h"
-
+#include "profile.h"
+#include "pte.h"
+#include "space.h"
+#include "swap.h"
+#include "tlb.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 
-static int count[MAX_PAGES] = {0};
-
 static void print_pte_entry(uint64_t* entry) {
     const char* dash = "-";
     const char* custom = dash;
     const char* write = dash;
     const char* read = dash;
     const char* valid = dash;
-    if (vms_pte_custom(entry)) {
+    if (pte_custom(entry)) {
         custom = "C";
     }
-    if (vms_pte_write(entry)) {
+    if (pte_write(entry)) {
         write = "W";
     }
-    if (vms_pte_read(entry)) {
+    if (pte_read(entry)) {
         read = "R";
     }
-    if (vms_pte_valid(entry)) {
+    if (pte_valid(entry)) {
         valid = "V";
     }
 
     printf("PPN: 0x%lX Flags: %s%s%s%s\n",
-        vms_pte_get_ppn(entry),
+        pte_get_ppn(entry),
         custom, write, read, valid);
 } //debugging function
 
-void page_fault_handler(void* virtual_address, int level, void* page_table) {
-    if (level == 0) {
-        uint64_t* entry = vms_page_table_pte_entry(page_table, virtual_address, level);
+static void huge_page_ref(void* page) {
+    for (int i = 0; i < NUM_PTE_ENTRIES; i++) {
+        vms_page_ref((uint8_t*) page + i * PAGE_SIZE);
+    }
+}
 
-        if (vms_pte_custom(entry) == 0) return;
+static void huge_page_unref(void* page) {
+    for (int i = 0; i < NUM_PTE_ENTRIES; i++) {
+        vms_page_unref((uint8_t*) page + i * PAGE_SIZE);
+    }
+}
 
-        if (vms_pte_write(entry) == 0) {
-            uint64_t entry_ppn = vms_pte_get_ppn(entry);
-            int entry_index = vms_get_page_index(vms_ppn_to_page(entry_ppn)); //get entry index
+static int huge_page_shared(void* page) {
+    for (int i = 0; i < NUM_PTE_ENTRIES; i++) {
+        if (vms_page_ref_count((uint8_t*) page + i * PAGE_SIZE) > 1) return 1;
+    }
+    return 0;
+}
+
+/* Replace the huge page leaf `entry` with an L0 table mapping the same 512
+   pages with the same permissions. Each L0 entry takes over the reference
+   the huge leaf held on its page, and its accessed and dirty bits, since
+   any of the pages may be the one that was written. */
+void split_huge_page(uint64_t* entry) {
+    void* l0 = vms_new_page();
+    if (l0 == NULL) exit(ENOMEM); //out of memory while handling the fault
+
+    uint64_t first_ppn = pte_get_ppn(entry);
+    for (int i = 0; i < NUM_PTE_ENTRIES; i++) {
+        uint64_t* entry_l0 = page_table_entry_from_index(l0, i);
+        pte_set_ppn(entry_l0, first_ppn + i);
+        pte_valid_set(entry_l0);
+        if (pte_read(entry)) pte_flag_set(entry_l0, PTE_READ);
+        if (pte_write(entry)) pte_flag_set(entry_l0, PTE_WRITE);
+        if (pte_custom(entry)) pte_flag_set(entry_l0, PTE_CUSTOM);
+        if (pte_accessed(entry)) pte_flag_set(entry_l0, PTE_ACCESSED);
+        if (pte_dirty(entry)) pte_flag_set(entry_l0, PTE_DIRTY);
+    }
 
-            if (count[entry_index] > 0) { //if more than one references
-                void* entry_copy = vms_new_page(); //create a copy 
-                memcpy(entry_copy, vms_ppn_to_page(vms_pte_get_ppn(entry)), PAGE_SIZE);
-                vms_pte_set_ppn(entry, vms_page_to_ppn(entry_copy)); 
-                count[entry_index]--;
+    pte_flag_clear(entry, PTE_ACCESSED);
+    pte_flag_clear(entry, PTE_DIRTY);
+    pte_flag_clear(entry, PTE_READ);
+    pte_flag_clear(entry, PTE_WRITE);
+    pte_flag_clear(entry, PTE_CUSTOM);
+    pte_flag_clear(entry, PTE_HUGE);
+    pte_set_ppn(entry, page_to_ppn(l0));
+    tlb_flush(); //cached translations point at the huge leaf
+}
+
+/* The page table below `entry` (at `level`) is shared copy-on-write, give
+   this address space its own copy. The tables or data pages it points to
+   gain a reference and are marked copy-on-write in both copies. */
+static void unshare_page_table(uint64_t* entry, int level) {
+    void* table = ppn_to_page(pte_get_ppn(entry));
+
+    if (vms_page_ref_count(table) > 1) { //other address spaces still use this table
+        void* table_copy = vms_new_page();
+        if (table_copy == NULL) exit(ENOMEM); //out of memory while handling the fault
+        if (level - 1 == 0) {
+            pte_table_share(table, table_copy, ~(uint64_t) 0); //copy, making writable pages COW in both
+        }
+        else {
+            memcpy(table_copy, table, PAGE_SIZE);
+        }
+        profile_event(VMS_EVENT_COPY, table, level, PAGE_SIZE);
+        memcpy(page_occupancy(table_copy), page_occupancy(table), OCCUPANCY_WORDS * sizeof(uint64_t));
+
+        for (int i = page_table_next_valid(table, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(table, i + 1)) {
+            uint64_t* entry_old = page_table_entry_from_index(table, i);
+            uint64_t* entry_new = page_table_entry_from_index(table_copy, i);
+            if (level - 1 != 0 && (!pte_huge(entry_old) || pte_write(entry_old))) {
+                pte_flag_clear(entry_old, PTE_WRITE); //leaf pages become COW
+                pte_flag_clear(entry_new, PTE_WRITE);
+                pte_flag_set(entry_old, PTE_CUSTOM); //lower tables become shared
+                pte_flag_set(entry_new, PTE_CUSTOM);
             }
 
-            vms_pte_write_set(entry); //enable
-            vms_pte_custom_clear(entry); //clear custom
+            void* page = ppn_to_page(pte_get_ppn(entry_old));
+            if (pte_swapped(entry_old)) swap_ref(entry_old); //both copies refer to the slot
+            else if (pte_huge(entry_old)) huge_page_ref(page); //one more reference
+            else vms_page_ref(page);
         }
+
+        pte_set_ppn(entry, page_to_ppn(table_copy));
+        vms_page_unref(table);
     }
+
+    pte_flag_clear(entry, PTE_CUSTOM); //this address space owns the table now
+    tlb_flush(); //cached translations may point into the old table
 }
 
-void* vms_fork_copy() {
-    void* parent_l2 = vms_get_root_page_table();
-    void* child_l2 = vms_new_page();
+/* Write to a copy-on-write huge page: reuse it if this is the only mapping
+   of all its pages, otherwise split it so only the written 4 KiB page is
+   copied by the level 0 handler */
+static void huge_page_fault(void* virtual_address, uint64_t* entry) {
+    if (!pte_custom(entry) || pte_write(entry)) return;
+
+    profile_event(VMS_EVENT_COW_FAULT, virtual_address, 1, 0);
+    if (huge_page_shared(ppn_to_page(pte_get_ppn(entry)))) {
+        split_huge_page(entry);
+        return;
+    }
+    pte_flag_set(entry, PTE_WRITE); //enable
+    pte_flag_clear(entry, PTE_CUSTOM); //clear custom
+}
 
-    for(int i = 0; i < NUM_PTE_ENTRIES; i++) {
-        uint64_t* entry_parent_l2 = vms_page_table_pte_entry_from_index(parent_l2, i);
+/* Allocate every missing table on the path to `virtual_address`, which
+   lies in `region`, and map its data page. Shared tables on the path are
+   unshared first so the new entries stay private. */
+static void demand_fault(void* virtual_address, struct region* region) {
+    void* page_table = vms_get_root_page_table();
+    for (int level = MMU_LEVELS - 1; level >= 0; --level) {
+        uint64_t* entry = page_table_entry(page_table, virtual_address, level);
+
+        if (pte_valid(entry)) {
+            if (level == 0 || pte_huge(entry)) return; //already populated
+            if (pte_custom(entry)) unshare_page_table(entry, level);
+        }
+        else if (pte_swapped(entry)) {
+            swap_in(entry); //populated before, but evicted since
+            return;
+        }
+        else {
+            //new table, or the data page at L0: zero-filled, from the file or the region's shared page
+            void* page = level == 0 ? mapping_fault_page(region, virtual_address) : vms_new_page();
+            if (page == NULL) exit(ENOMEM); //out of memory while handling the fault
+            pte_set_ppn(entry, page_to_ppn(page));
+            pte_valid_set(entry);
+            if (level == 0) {
+                if (region->prot & VMS_PROT_READ) pte_flag_set(entry, PTE_READ);
+                if (region->prot & VMS_PROT_WRITE) pte_flag_set(entry, PTE_WRITE);
+                if (region->shared != NULL) pte_flag_set(entry, PTE_SHARED);
+                return;
+            }
+        }
+        page_table = ppn_to_page(pte_get_ppn(entry));
+    }
+}
 
-        if(vms_pte_valid(entry_parent_l2)) { //find the index on L2
-            void* child_l1 = vms_new_page();
-            uint64_t child_l1_ppn = vms_page_to_ppn(child_l1); //get pnn for child L1 page
-            uint64_t* entry_child_l2 = vms_page_table_pte_entry_from_index(child_l2,i);
-            vms_pte_set_ppn(entry_child_l2, child_l1_ppn); //write L1 pnn to L2
-            vms_pte_valid_set(entry_child_l2); //set valid bit
+void page_fault_handler(void* virtual_address,
+                        int level,
+                        void* page_table,
+                        enum vms_fault_reason reason) {
+    uint64_t* entry = page_table_entry(page_table, virtual_address, level);
+    swap_count_fault();
+    profile_event(VMS_EVENT_FAULT, virtual_address, level, reason);
 
-            uint64_t parent_l1_ppn = vms_pte_get_ppn(entry_parent_l2); //get L1 pnn for parent
+    if (pte_swapped(entry)) {
+        swap_in(entry); //the only entry referring to the page, so shared tables can be updated in place
+    }
+    else if (!pte_valid(entry)) {
+        struct region* region = space_find_region(vms_get_root_page_table(), virtual_address);
+        if (region != NULL) demand_fault(virtual_address, region);
+    }
+    else if (level == 1 && pte_huge(entry)) {
+        huge_page_fault(virtual_address, entry);
+    }
+    else if (level != 0) {
+        if (pte_custom(entry)) unshare_page_table(entry, level);
+    }
+    else if (pte_custom(entry) && !pte_write(entry)) {
+        void* page = ppn_to_page(pte_get_ppn(entry));
+        profile_event(VMS_EVENT_COW_FAULT, virtual_address, level, 0);
+
+        if (vms_page_ref_count(page) > 1) { //if more than one references
+            void* entry_copy = vms_new_page(); //create a copy 
+            if (entry_copy == NULL) exit(ENOMEM); //out of memory while handling the fault
+            memcpy(entry_copy, page, PAGE_SIZE);
+            profile_event(VMS_EVENT_COPY, virtual_address, level, PAGE_SIZE);
+            pte_set_ppn(entry, page_to_ppn(entry_copy)); 
+            vms_page_unref(page); //drop our reference to the shared page
+        }
+        //otherwise this is the last reference, so reuse the page in place
+
+        pte_flag_set(entry, PTE_WRITE); //enable
+        pte_flag_clear(entry, PTE_CUSTOM); //clear custom
+    }
+}
+
+static int map_range(void* virtual_address, size_t length, int prot, int flags, int fd, uint64_t offset) {
+    uint64_t start = (uint64_t) virtual_address;
+    uint64_t end = start + length;
+    uint64_t limit = (uint64_t) 1 << (12 + 9 * MMU_LEVELS);
+    if (length == 0 || start % PAGE_SIZE != 0 || length % PAGE_SIZE != 0
+        || end > limit || end < start || offset % PAGE_SIZE != 0) {
+        return EINVAL;
+    }
+
+    struct region mapping = {start, end, prot, flags, fd, offset, NULL, NULL};
+    int err = space_add_region(vms_get_root_page_table(), &mapping);
+    if (err != 0) return err;
 
-            for(int j = 0; j < NUM_PTE_ENTRIES; j++) {
-                uint64_t* entry_parent_l1 = vms_page_table_pte_entry_from_index(vms_ppn_to_page(parent_l1_ppn), j); //get entries on the L1 page
+    if (flags & VMS_MAP_POPULATE) {
+        struct region* region = space_find_region(vms_get_root_page_table(), virtual_address);
+        for (uint64_t address = start; address < end; address += PAGE_SIZE) {
+            demand_fault((void*) address, region);
+        }
+    }
+    return 0;
+}
 
-                if(vms_pte_valid(entry_parent_l1)) { //find index on L1
-                    void* child_l0 = vms_new_page();
-                    uint64_t child_l0_ppn = vms_page_to_ppn(child_l0); //get pnn for child L0 page
-                    uint64_t* entry_child_l1 = vms_page_table_pte_entry_from_index(child_l1,j);
-                    vms_pte_set_ppn(entry_child_l1, child_l0_ppn); //write L0 pnn to L1
-                    vms_pte_valid_set(entry_child_l1); //set valid bit
+/* Drop this reference to `page_table`, releasing everything below it if
+   no other address space shares it */
+static void release_page_table(void* page_table, int level) {
+    if (vms_page_ref_count(page_table) == 1) {
+        for (int i = page_table_next_valid(page_table, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(page_table, i + 1)) {
+            uint64_t* entry = page_table_entry_from_index(page_table, i);
+            void* page = ppn_to_page(pte_get_ppn(entry));
+            if (level == 0 && pte_swapped(entry)) {
+                swap_unref(entry); //evicted data page, its slot is freed if not shared
+            }
+            else if (level == 0) {
+                vms_page_unref(page); //data page, freed if not shared
+            }
+            else if (level == 1 && pte_huge(entry)) {
+                huge_page_unref(page);
+            }
+            else {
+                release_page_table(page, level - 1);
+            }
+        }
+    }
+    vms_page_unref(page_table);
+}
 
-                    uint64_t parent_l0_ppn = vms_pte_get_ppn(entry_parent_l1); //get L0 pnn for parent
+int vms_map_range(void* virtual_address, size_t length, int prot, int flags) {
+    mmu_lock_exclusive();
+    int err = map_range(virtual_address, length, prot, flags, -1, 0);
+    mmu_unlock();
+    return err;
+}
 
-                    for (int k = 0; k < NUM_PTE_ENTRIES; k++) {
+int vms_map_file(void* virtual_address, size_t length, int prot, int flags, int fd, uint64_t offset) {
+    if (fd < 0) return EBADF;
+    mmu_lock_exclusive();
+    int err = map_range(virtual_address, length, prot, flags, fd, offset);
+    mmu_unlock();
+    return err;
+}
 
-                        uint64_t* entry_parent_l0 = vms_page_table_pte_entry_from_index(vms_ppn_to_page(parent_l0_ppn), k); //get entries on the L0 page
+static void destroy_address_space(void* root_page_table) {
+    check_page_aligned(root_page_table);
+    mapping_drop_space(root_page_table);
+    space_destroy(root_page_table);
+    release_page_table(root_page_table, MMU_LEVELS - 1);
+}
 
-                        if(vms_pte_valid(entry_parent_l0)) { //find index on L0
-                            //print_pte_entry(entry_child_l2);
-                            void* child_p0 = vms_new_page();
-                            uint64_t child_p0_ppn = vms_page_to_ppn(child_p0); //get pnn for child p0 page
-                            uint64_t* entry_child_l0 = vms_page_table_pte_entry_from_index(child_l0,k);
-                            vms_pte_set_ppn(entry_child_l0, child_p0_ppn); //write p0 pnn to L0
-                            vms_pte_valid_set(entry_child_l0); //set valid bit
-                            if(vms_pte_read(entry_parent_l0)) vms_pte_read_set(entry_child_l0); //set read bit
-                            if(vms_pte_write(entry_parent_l0)) vms_pte_write_set(entry_child_l0); //set write bit
+void vms_destroy_address_space(void* root_page_table) {
+    mmu_lock_exclusive();
+    destroy_address_space(root_page_table);
+    mmu_unlock();
+}
 
-                            uint64_t parent_p0_ppn = vms_pte_get_ppn(entry_parent_l0); //get p0 pnn for parent
-                            void* parent_p0 = vms_ppn_to_page(parent_p0_ppn); //get p0 parent page pointer
+struct scan {
+    uint64_t bit;
+    void (*clear)(uint64_t*);
+    void** addresses;
+    size_t max;
+    size_t found;
+};
+
+static void scan_found(struct scan* scan, uint64_t* entry, uint64_t address) {
+    if (scan->found < scan->max && scan->addresses != NULL) {
+        scan->addresses[scan->found] = (void*) address;
+    }
+    ++scan->found;
+    if (scan->clear != NULL) scan->clear(entry);
+}
 
-                           memcpy(child_p0, parent_p0, PAGE_SIZE); //copy p0 parent page to p0 child page
-                        } 
-                    } 
-                }
+static void scan_page_table(void* page_table, int level, uint64_t base, struct scan* scan) {
+    int shift = 12 + 9 * level;
+    if (level == 0) { //vector pass for the valid entries with the bit, swapped pages are clean and not accessed
+        uint64_t mask[OCCUPANCY_WORDS];
+        pte_table_mask(page_table, PTE_VALID | scan->bit, mask);
+        for (int word = 0; word < OCCUPANCY_WORDS; ++word) {
+            for (uint64_t bits = mask[word]; bits != 0; bits &= bits - 1) {
+                int i = word * 64 + __builtin_ctzll(bits);
+                scan_found(scan, page_table_entry_from_index(page_table, i), base | ((uint64_t) i << shift));
             }
         }
+        return;
+    }
+
+    for (int i = page_table_next_valid(page_table, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(page_table, i + 1)) {
+        uint64_t* entry = page_table_entry_from_index(page_table, i);
+        uint64_t address = base | ((uint64_t) i << shift);
+        if (!pte_valid(entry)) continue;
+
+        if (!pte_huge(entry)) {
+            scan_page_table(ppn_to_page(pte_get_ppn(entry)), level - 1, address, scan);
+        }
+        else if (pte_load(entry) & scan->bit) {
+            scan_found(scan, entry, address);
+        }
     }
-    return child_l2;
 }
 
-void* vms_fork_copy_on_write() {
-    void* parent_l2 = vms_get_root_page_table();
-    void* child_l2 = vms_new_page();
+static size_t scan_address_space(struct scan* scan) {
+    mmu_lock_exclusive();
+    scan_page_table(vms_get_root_page_table(), MMU_LEVELS - 1, 0, scan);
+    mmu_unlock();
+    return scan->found;
+}
+
+size_t vms_scan_accessed(void** addresses, size_t max, int clear) {
+    struct scan scan = {PTE_ACCESSED, clear ? vms_pte_accessed_clear : NULL, addresses, max, 0};
+    return scan_address_space(&scan);
+}
+
+/* Once the dirty bit is cleared, a copy of the page kept in swap can no
+   longer be trusted to match it */
+static void dirty_clear(uint64_t* entry) {
+    void* page = ppn_to_page(pte_get_ppn(entry));
+    if (!pte_huge(entry) && *page_swap_copy(page) != 0) swap_drop_copy(page);
+    pte_flag_clear(entry, PTE_DIRTY);
+}
+
+size_t vms_scan_dirty(void** addresses, size_t max, int clear) {
+    struct scan scan = {PTE_DIRTY, clear ? dirty_clear : NULL, addresses, max, 0};
+    return scan_address_space(&scan);
+}
+
+static void* fork_failed(void* child_l2) {
+    destroy_address_space(child_l2); //release the partial copy
+    return NULL;
+}
+
+/* Map the page of a VMS_MAP_SHARED leaf in the child of an eager fork
+   too, with the same rights */
+static void share_page(uint64_t* entry_parent, uint64_t* entry_child) {
+    vms_page_ref(ppn_to_page(pte_get_ppn(entry_parent)));
+    pte_set_ppn(entry_child, pte_get_ppn(entry_parent));
+    pte_valid_set(entry_child);
+    pte_flag_set(entry_child, pte_load(entry_parent) & (PTE_READ | PTE_WRITE | PTE_SHARED));
+}
 
-    for(int i = 0; i < NUM_PTE_ENTRIES; i++) {
-        uint64_t* entry_parent_l2 = vms_page_table_pte_entry_from_index(parent_l2, i);
-
-        if(vms_pte_valid(entry_parent_l2)) { //find the index on L2
-            void* child_l1 = vms_new_page();
-            uint64_t child_l1_ppn = vms_page_to_ppn(child_l1); //get pnn for child L1 page
-            uint64_t* entry_child_l2 = vms_page_table_pte_entry_from_index(child_l2,i);
-            vms_pte_set_ppn(entry_child_l2, child_l1_ppn); //write L1 pnn to L2
-            vms_pte_valid_set(entry_child_l2); //set valid bit
-
-            uint64_t parent_l1_ppn = vms_pte_get_ppn(entry_parent_l2); //get L1 pnn for parent
-
-            for(int j = 0; j < NUM_PTE_ENTRIES; j++) {
-                uint64_t* entry_parent_l1 = vms_page_table_pte_entry_from_index(vms_ppn_to_page(parent_l1_ppn), j); //get entries on the L1 page
-
-                if(vms_pte_valid(entry_parent_l1)) { //find index on L1
-                    void* child_l0 = vms_new_page();
-                    uint64_t child_l0_ppn = vms_page_to_ppn(child_l0); //get pnn for child L0 page
-                    uint64_t* entry_child_l1 = vms_page_table_pte_entry_from_index(child_l1,j);
-                    vms_pte_set_ppn(entry_child_l1, child_l0_ppn); //write L0 pnn to L1
-                    vms_pte_valid_set(entry_child_l1); //set valid bit
-
-                    uint64_t parent_l0_ppn = vms_pte_get_ppn(entry_parent_l1); //get L0 pnn for parent
-
-                    for (int k = 0; k < NUM_PTE_ENTRIES; k++) {
-
-                        uint64_t* entry_parent_l0 = vms_page_table_pte_entry_from_index(vms_ppn_to_page(parent_l0_ppn), k); //get entries on the L0 page
-
-                        if(vms_pte_valid(entry_parent_l0)) { //find index on L0
-                            uint64_t parent_p0_ppn = vms_pte_get_ppn(entry_parent_l0); //get pnn for parent p0 page
-                            uint64_t* entry_child_l0 = vms_page_table_pte_entry_from_index(child_l0,k);
-                            vms_pte_set_ppn(entry_child_l0, parent_p0_ppn); //write p0 pnn to L0
-                            vms_pte_valid_set(entry_child_l0); //set valid bit
-                            if(vms_pte_read(entry_parent_l0)) vms_pte_read_set(entry_child_l0); //set read bit
-                            if(vms_pte_write(entry_parent_l0)) {
-                                vms_pte_custom_set(entry_child_l0); //set child custom bit
-                                vms_pte_custom_set(entry_parent_l0); //set parent costum bit
-                                vms_pte_write_clear(entry_parent_l0); //clear parents write bit 
-                            }
-                            if(vms_pte_custom(entry_parent_l0)) {
-                                vms_pte_custom_set(entry_child_l0); //if parent costum bit, set child's
-                            }
-                        
-                            count[vms_get_page_index(vms_ppn_to_page(parent_p0_ppn))]++; //track number of copies
-                        }
-                    } 
-                }
+/* Give the leaf `entry_child`, mapping a private copy of the page of
+   `entry_parent`, the parent's rights. A page the parent still shares
+   copy-on-write was writable before, and the copy is not shared. */
+static void copy_rights(uint64_t* entry_parent, uint64_t* entry_child) {
+    if (pte_read(entry_parent)) pte_flag_set(entry_child, PTE_READ);
+    if (pte_write(entry_parent) || pte_custom(entry_parent)) pte_flag_set(entry_child, PTE_WRITE);
+}
+
+/* Fill `child`, a new table at `level`, with copies of the tables below
+   the parent table and of the data and huge pages they map */
+static int copy_page_table(void* parent, void* child, int level) {
+    //only visit valid entries, using each table's occupancy bitmap
+    for (int i = page_table_next_valid(parent, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(parent, i + 1)) {
+        uint64_t* entry_parent = page_table_entry_from_index(parent, i);
+        uint64_t* entry_child = page_table_entry_from_index(child, i);
+
+        if (level == 0 && pte_shared(entry_parent)) { //shared mapping, both map the same page
+            share_page(entry_parent, entry_child);
+            continue;
+        }
+        if (level == 0) { //data page
+            void* child_page = vms_new_page();
+            if (child_page == NULL) return ENOMEM;
+            pte_set_ppn(entry_child, page_to_ppn(child_page));
+            pte_valid_set(entry_child);
+            copy_rights(entry_parent, entry_child);
+
+            if (pte_swapped(entry_parent)) { //evicted, possibly by the allocation above
+                swap_read(entry_parent, child_page);
+                continue;
             }
+            memcpy(child_page, ppn_to_page(pte_get_ppn(entry_parent)), PAGE_SIZE);
+            continue;
+        }
+
+        if (level == 1 && pte_huge(entry_parent)) { //huge page, copy all 2 MiB
+            void* child_huge = vms_new_huge_page();
+            if (child_huge == NULL) return ENOMEM;
+            pte_set_ppn(entry_child, page_to_ppn(child_huge));
+            pte_valid_set(entry_child);
+            pte_flag_set(entry_child, PTE_HUGE);
+            copy_rights(entry_parent, entry_child);
+            memcpy(child_huge, ppn_to_page(pte_get_ppn(entry_parent)), HUGE_PAGE_SIZE);
+            continue;
         }
+
+        void* child_table = vms_new_page();
+        if (child_table == NULL) return ENOMEM;
+        pte_set_ppn(entry_child, page_to_ppn(child_table));
+        pte_valid_set(entry_child);
+        int err = copy_page_table(ppn_to_page(pte_get_ppn(entry_parent)), child_table, level - 1);
+        if (err != 0) return err;
+    }
+    return 0;
+}
+
+static void* fork_copy() {
+    void* parent_root = vms_get_root_page_table();
+    void* child_root = vms_new_page();
+    if (child_root == NULL) return NULL;
+
+    if (copy_page_table(parent_root, child_root, MMU_LEVELS - 1) != 0) return fork_failed(child_root);
+    if (space_fork(parent_root, child_root) != 0) return fork_failed(child_root); //inherit mappings
+    return child_root;
+}
+
+/* One L1 entry of the parent: a level 0 table whose data pages a worker
+   copies, or a huge page */
+struct fork_work {
+    uint64_t* entry_parent_l1;
+    uint64_t* entry_child_l1;
+};
+
+struct fork_workers {
+    void* parent_root;
+    struct fork_work* items;
+    size_t count;
+    size_t next;
+    int failed;
+};
+
+static void fork_copy_work(struct fork_work* work, struct fork_workers* workers) {
+    void* child = ppn_to_page(pte_get_ppn(work->entry_child_l1));
+    void* parent = ppn_to_page(pte_get_ppn(work->entry_parent_l1));
+    if (pte_huge(work->entry_parent_l1)) {
+        memcpy(child, parent, HUGE_PAGE_SIZE);
+        return;
+    }
+
+    for (int k = page_table_next_valid(parent, 0); k < NUM_PTE_ENTRIES; k = page_table_next_valid(parent, k + 1)) {
+        uint64_t* entry_parent_l0 = page_table_entry_from_index(parent, k);
+        uint64_t* entry_child_l0 = page_table_entry_from_index(child, k);
+        if (pte_shared(entry_parent_l0)) {
+            share_page(entry_parent_l0, entry_child_l0);
+            continue;
+        }
+
+        void* child_p0 = vms_new_page();
+        if (child_p0 == NULL) {
+            __atomic_store_n(&workers->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        pte_set_ppn(entry_child_l0, page_to_ppn(child_p0));
+        pte_valid_set(entry_child_l0);
+        copy_rights(entry_parent_l0, entry_child_l0);
+        memcpy(child_p0, ppn_to_page(pte_get_ppn(entry_parent_l0)), PAGE_SIZE);
+    }
+}
+
+static void fork_copy_all(struct fork_workers* workers) {
+    while (!__atomic_load_n(&workers->failed, __ATOMIC_RELAXED)) {
+        size_t n = __atomic_fetch_add(&workers->next, 1, __ATOMIC_RELAXED);
+        if (n >= workers->count) break;
+        fork_copy_work(&workers->items[n], workers);
+    }
+}
+
+static void* fork_worker(void* argument) {
+    struct fork_workers* workers = argument;
+    mmu_lock_borrow(workers->parent_root); //the forking thread holds it
+    fork_copy_all(workers);
+    mmu_lock_return();
+    return NULL;
+}
+
+static int fork_work_push(struct fork_workers* workers, size_t* capacity, uint64_t* entry_parent_l1, uint64_t* entry_child_l1) {
+    if (workers->count == *capacity) {
+        size_t grown = *capacity == 0 ? 64 : *capacity * 2;
+        struct fork_work* items = realloc(workers->items, grown * sizeof(struct fork_work));
+        if (items == NULL) return ENOMEM;
+        workers->items = items;
+        *capacity = grown;
+    }
+    workers->items[workers->count++] = (struct fork_work) {entry_parent_l1, entry_child_l1};
+    return 0;
+}
+
+static void* fork_parallel_failed(void* child_l2, struct fork_workers* workers) {
+    free(workers->items);
+    return fork_failed(child_l2);
+}
+
+/* Build the child's tables from `level` down to level 1 and allocate its
+   level 0 tables and huge pages, queueing one work item per level 1 entry */
+static int prepare_parallel_copy(void* parent, void* child, int level, struct fork_workers* workers, size_t* capacity) {
+    for (int i = page_table_next_valid(parent, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(parent, i + 1)) {
+        uint64_t* entry_parent = page_table_entry_from_index(parent, i);
+        uint64_t* entry_child = page_table_entry_from_index(child, i);
+
+        if (level == 1) {
+            int huge = pte_huge(entry_parent);
+            void* child_page = huge ? vms_new_huge_page() : vms_new_page();
+            if (child_page == NULL) return ENOMEM;
+            pte_set_ppn(entry_child, page_to_ppn(child_page));
+            pte_valid_set(entry_child);
+            if (huge) {
+                pte_flag_set(entry_child, PTE_HUGE);
+                copy_rights(entry_parent, entry_child);
+            }
+            if (fork_work_push(workers, capacity, entry_parent, entry_child) != 0) return ENOMEM;
+            continue;
+        }
+
+        void* child_table = vms_new_page();
+        if (child_table == NULL) return ENOMEM;
+        pte_set_ppn(entry_child, page_to_ppn(child_table));
+        pte_valid_set(entry_child);
+        int err = prepare_parallel_copy(ppn_to_page(pte_get_ppn(entry_parent)), child_table, level - 1, workers, capacity);
+        if (err != 0) return err;
+    }
+    return 0;
+}
+
+/* Same result as vms_fork_copy. The calling thread builds the tables down
+   to level 1 (and allocates the level 0 tables and huge pages), then it
+   and `threads - 1` workers share out the L1 entries and copy the data
+   pages under them. Each level 0 table is filled by a single thread. */
+static void* fork_copy_parallel(int threads) {
+    if (threads <= 1 || swap_enabled()) {
+        return fork_copy(); //eviction would change the parent under the workers
+    }
+
+    void* parent_root = vms_get_root_page_table();
+    void* child_root = vms_new_page();
+    if (child_root == NULL) return NULL;
+
+    struct fork_workers workers = {parent_root, NULL, 0, 0, 0};
+    size_t capacity = 0;
+    if (prepare_parallel_copy(parent_root, child_root, MMU_LEVELS - 1, &workers, &capacity) != 0) {
+        return fork_parallel_failed(child_root, &workers);
+    }
+
+    pthread_t* pool = malloc((threads - 1) * sizeof(pthread_t));
+    int started = 0;
+    while (pool != NULL && started < threads - 1 && (size_t) started + 1 < workers.count) {
+        if (pthread_create(&pool[started], NULL, fork_worker, &workers) != 0) break; //the rest run on fewer threads
+        ++started;
+    }
+    fork_copy_all(&workers);
+    for (int t = 0; t < started; ++t) {
+        pthread_join(pool[t], NULL);
+    }
+    free(pool);
+
+    if (workers.failed) return fork_parallel_failed(child_root, &workers);
+    free(workers.items);
+    if (space_fork(parent_root, child_root) != 0) return fork_failed(child_root); //inherit mappings
+    return child_root;
+}
+
+/* Fill `child`, a new table at `level`, with copies of the tables below
+   the parent table, sharing the data and huge pages copy-on-write */
+static int share_page_table_cow(void* parent, void* child, int level) {
+    if (level == 0) {
+        //one vector pass: writable pages become COW in both, the child gets no accessed bits and keeps W
+        //only on shared pages. It keeps the dirty bits: a page's clean copy in swap is only trusted
+        //while none of its entries is dirty, whichever of them outlives the other.
+        pte_table_share(parent, child, PTE_PPN_MASK | PTE_CUSTOM | PTE_SWAPPED | PTE_SHARED | PTE_DIRTY | PTE_WRITE | PTE_READ | PTE_VALID);
+        memcpy(page_occupancy(child), page_occupancy(parent), OCCUPANCY_WORDS * sizeof(uint64_t));
+
+        for (int k = page_table_next_valid(parent, 0); k < NUM_PTE_ENTRIES; k = page_table_next_valid(parent, k + 1)) {
+            uint64_t* entry_parent = page_table_entry_from_index(parent, k);
+            if (pte_swapped(entry_parent)) swap_ref(entry_parent); //the child shares the slot
+            else vms_page_ref(ppn_to_page(pte_get_ppn(entry_parent))); //track number of copies
+        }
+        return 0;
+    }
+
+    //only visit valid entries, using each table's occupancy bitmap
+    for (int i = page_table_next_valid(parent, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(parent, i + 1)) {
+        uint64_t* entry_parent = page_table_entry_from_index(parent, i);
+        uint64_t* entry_child = page_table_entry_from_index(child, i);
+
+        if (level == 1 && pte_huge(entry_parent)) { //huge page, share all 2 MiB
+            uint64_t parent_huge_ppn = pte_get_ppn(entry_parent);
+            pte_set_ppn(entry_child, parent_huge_ppn);
+            pte_valid_set(entry_child);
+            pte_flag_set(entry_child, PTE_HUGE);
+            if(pte_read(entry_parent)) pte_flag_set(entry_child, PTE_READ); //set read bit
+            if(pte_write(entry_parent)) {
+                pte_flag_set(entry_parent, PTE_CUSTOM); //set parent custom bit
+                pte_flag_clear(entry_parent, PTE_WRITE); //clear parents write bit
+            }
+            if(pte_custom(entry_parent)) pte_flag_set(entry_child, PTE_CUSTOM); //copy custom bit
+            huge_page_ref(ppn_to_page(parent_huge_ppn)); //track number of copies
+            continue;
+        }
+
+        void* child_table = vms_new_page();
+        if (child_table == NULL) return ENOMEM;
+        pte_set_ppn(entry_child, page_to_ppn(child_table));
+        pte_valid_set(entry_child);
+        int err = share_page_table_cow(ppn_to_page(pte_get_ppn(entry_parent)), child_table, level - 1);
+        if (err != 0) return err;
+    }
+    return 0;
+}
+
+static void* fork_copy_on_write() {
+    void* parent_root = vms_get_root_page_table();
+    void* child_root = vms_new_page();
+    if (child_root == NULL) return NULL;
+
+    if (share_page_table_cow(parent_root, child_root, MMU_LEVELS - 1) != 0) return fork_failed(child_root);
+    if (space_fork(parent_root, child_root) != 0) return fork_failed(child_root); //inherit mappings
+    return child_root;
+}
+
+/* A child of the address space rooted at `parent_l2` that shares the
+   tables below its root copy-on-write, marked with the custom bit on both
+   sides */
+static void* share_address_space(void* parent_l2) {
+    void* child_l2 = vms_new_page();
+    if (child_l2 == NULL) return NULL;
+
+    for(int i = page_table_next_valid(parent_l2, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(parent_l2, i + 1)) {
+        uint64_t* entry_parent_l2 = page_table_entry_from_index(parent_l2, i);
+
+        //share the L1 table instead of copying it
+        uint64_t parent_l1_ppn = pte_get_ppn(entry_parent_l2);
+        uint64_t* entry_child_l2 = page_table_entry_from_index(child_l2, i);
+        pte_set_ppn(entry_child_l2, parent_l1_ppn); //write L1 pnn to L2
+        pte_valid_set(entry_child_l2); //set valid bit
+        pte_flag_set(entry_child_l2, PTE_CUSTOM); //set child custom bit
+        pte_flag_set(entry_parent_l2, PTE_CUSTOM); //set parent custom bit
+
+        vms_page_ref(ppn_to_page(parent_l1_ppn)); //track number of sharers
+    }
+    tlb_flush(); //the parent's cached translations now cross a shared table
+
+    if (space_fork(parent_l2, child_l2) != 0) return fork_failed(child_l2); //inherit mappings
+    return child_l2;
+}
+
+static void* fork_copy_on_write_shared() {
+    return share_address_space(vms_get_root_page_table());
+}
+
+/* Forks read the parent's tables and may write-protect its entries, so no
+   other thread may translate through them meanwhile */
+static void* fork_profiled(void* child_l2, uint64_t start) {
+    if (child_l2 != NULL && profile_enabled()) {
+        profile_record(VMS_EVENT_FORK, child_l2, 0, profile_clock() - start);
     }
     return child_l2;
 }
+
+static void* fork_exclusive(void* (*fork)()) {
+    uint64_t start = profile_enabled() ? profile_clock() : 0;
+    mmu_lock_exclusive();
+    void* child_l2 = fork();
+    mmu_unlock();
+    return fork_profiled(child_l2, start);
+}
+
+void* vms_fork_copy() {
+    return fork_exclusive(fork_copy);
+}
+
+void* vms_fork_copy_parallel(int threads) {
+    uint64_t start = profile_enabled() ? profile_clock() : 0;
+    mmu_lock_exclusive();
+    void* child_l2 = fork_copy_parallel(threads);
+    mmu_unlock();
+    return fork_profiled(child_l2, start);
+}
+
+void* vms_fork_copy_on_write() {
+    return fork_exclusive(fork_copy_on_write);
+}
+
+void* vms_fork_copy_on_write_shared() {
+    return fork_exclusive(fork_copy_on_write_shared);
+}
+
+/* The snapshot shares the tables below the root, so taking one costs a
+   page and a pass over the root table; pages are copied as either side
+   writes */
+static void* snapshot(void* root_page_table) {
+    struct address_space* origin = space_get_or_create(root_page_table);
+    if (origin == NULL) return NULL;
+    void* snapshot_l2 = share_address_space(root_page_table);
+    if (snapshot_l2 == NULL) return NULL;
+    struct address_space* state = space_get_or_create(snapshot_l2);
+    if (state == NULL) return fork_failed(snapshot_l2);
+    state->snapshot_of = root_page_table;
+    state->snapshot_of_id = origin->id;
+    return snapshot_l2;
+}
+
+void* vms_snapshot(void* root_page_table) {
+    if (root_page_table == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    check_page_aligned(root_page_table);
+    mmu_lock_exclusive();
+    void* snapshot_l2 = snapshot(root_page_table);
+    mmu_unlock();
+    return snapshot_l2;
+}
+
+/* Drop every table below the root of the address space and share the
+   snapshot's instead, the same way share_address_space does */
+static int restore(void* snapshot_l2) {
+    struct address_space* state = space_get(snapshot_l2);
+    if (state == NULL || state->snapshot_of == NULL) return EINVAL;
+    void* root_l2 = state->snapshot_of;
+    struct address_space* origin = space_get(root_l2);
+    if (origin == NULL || origin->id != state->snapshot_of_id) return EINVAL; //destroyed since
+
+    mapping_drop_space(root_l2);
+    int err = space_replace_regions(root_l2, snapshot_l2);
+    if (err != 0) return err;
+
+    for (int i = page_table_next_valid(root_l2, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(root_l2, i + 1)) {
+        uint64_t* entry = page_table_entry_from_index(root_l2, i);
+        release_page_table(ppn_to_page(pte_get_ppn(entry)), MMU_LEVELS - 2);
+        pte_valid_clear(entry);
+        *entry = 0;
+    }
+    for (int i = page_table_next_valid(snapshot_l2, 0); i < NUM_PTE_ENTRIES; i = page_table_next_valid(snapshot_l2, i + 1)) {
+        uint64_t l1_ppn = pte_get_ppn(page_table_entry_from_index(snapshot_l2, i));
+        uint64_t* entry = page_table_entry_from_index(root_l2, i);
+        pte_set_ppn(entry, l1_ppn);
+        pte_valid_set(entry);
+        pte_flag_set(entry, PTE_CUSTOM); //the snapshot's entry has it already
+        vms_page_ref(ppn_to_page(l1_ppn));
+    }
+    tlb_flush(); //cached translations point into the dropped tables
+    return 0;
+}
+
+int vms_restore(void* snapshot) {
+    if (snapshot == NULL) return EINVAL;
+    check_page_aligned(snapshot);
+    mmu_lock_exclusive();
+    int err = restore(snapshot);
+    mmu_unlock();
+    return err;
+}
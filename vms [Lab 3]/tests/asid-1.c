@@ -0,0 +1,70 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <errno.h>
+
+int expected_exit_status() { return 0; }
+
+static uint64_t misses() {
+    struct vms_tlb_stats stats;
+    vms_tlb_get_stats(&stats);
+    return stats.misses;
+}
+
+void test() {
+    vms_init();
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    uint8_t* virtual_address = (uint8_t*) 0x40000000;
+    assert(vms_map_range(virtual_address, PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    vms_write(virtual_address, 1);
+
+    void* forked_l2 = vms_fork_copy_on_write();
+    int parent = vms_asid_create(l2);
+    int child = vms_asid_create(forked_l2);
+    assert(parent > 0 && child > 0 && parent != child);
+    assert(vms_asid_create(l2) == parent);
+    assert(vms_get_asid() == parent);
+    assert(vms_asid_root_page_table(child) == forked_l2);
+
+    /* Switching keeps the other address space's translations cached */
+    assert(vms_switch(child) == 0);
+    assert(vms_get_root_page_table() == forked_l2);
+    vms_write(virtual_address, 2);
+    assert(vms_switch(parent) == 0);
+    assert(vms_read(virtual_address) == 1);
+    uint64_t before = misses();
+    for (int i = 0; i < 4; ++i) {
+        assert(vms_switch(child) == 0);
+        assert(vms_read(virtual_address) == 2);
+        assert(vms_switch(parent) == 0);
+        assert(vms_read(virtual_address) == 1);
+    }
+    assert(misses() == before);
+
+    /* Flushing one ASID leaves the other alone */
+    vms_tlb_flush_asid(child);
+    assert(vms_read(virtual_address) == 1);
+    assert(misses() == before);
+    assert(vms_switch(child) == 0);
+    assert(vms_read(virtual_address) == 2);
+    assert(misses() == before + 1);
+
+    /* Released ASIDs can no longer be switched to */
+    assert(vms_asid_release(child) == 0);
+    assert(vms_get_asid() == 0);
+    assert(vms_switch(child) == EINVAL);
+    assert(vms_asid_release(child) == EINVAL);
+    assert(vms_switch(0) == EINVAL);
+    assert(vms_read(virtual_address) == 2);
+
+    /* Destroying an address space gives its ASID back */
+    child = vms_asid_create(forked_l2);
+    assert(child > 0);
+    vms_destroy_address_space(forked_l2);
+    assert(vms_switch(child) == EINVAL);
+    assert(vms_switch(parent) == 0);
+    assert(vms_read(virtual_address) == 1);
+}
@@ -0,0 +1,71 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+int expected_exit_status() { return 0; }
+
+static uint8_t* const virtual_address = (uint8_t*) 0x40000000;
+static void* first;
+static int first_asid;
+static int step = 0;
+
+static void wait_for(int value) {
+    while (__atomic_load_n(&step, __ATOMIC_ACQUIRE) != value) {
+        sched_yield();
+    }
+}
+
+/* Runs in the first address space while its ASID is taken away and handed
+   to the second one */
+static void* worker(void* argument) {
+    (void) argument;
+    vms_switch(first_asid);
+    assert(vms_read(virtual_address) == 1);
+    __atomic_store_n(&step, 1, __ATOMIC_RELEASE);
+
+    wait_for(2);
+    assert(vms_read(virtual_address) == 1);
+    assert(vms_switch(first_asid) == 0);
+    assert(vms_get_root_page_table() != first);
+    assert(vms_read(virtual_address) == 2);
+    return NULL;
+}
+
+void test() {
+    vms_init();
+
+    first = vms_new_page();
+    vms_set_root_page_table(first);
+    assert(vms_map_range(virtual_address, PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    vms_write(virtual_address, 1);
+    void* second = vms_new_page();
+    vms_set_root_page_table(second);
+    assert(vms_map_range(virtual_address, PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    vms_write(virtual_address, 2);
+    first_asid = vms_asid_create(first);
+    assert(first_asid > 0);
+
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, worker, NULL) == 0);
+    wait_for(1);
+
+    /* Recycle the ASID: hand out others until it comes round again */
+    assert(vms_asid_release(first_asid) == 0);
+    int asid;
+    while ((asid = vms_asid_create(second)) != first_asid) {
+        assert(asid > 0);
+        assert(vms_asid_release(asid) == 0);
+    }
+    assert(vms_get_asid() == first_asid);
+    __atomic_store_n(&step, 2, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    vms_destroy_address_space(first);
+    vms_set_root_page_table(second);
+    vms_destroy_address_space(second);
+    assert(vms_get_used_pages() == 0);
+}
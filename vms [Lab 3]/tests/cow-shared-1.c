@@ -0,0 +1,92 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    vms_init();
+
+    void* l2 = vms_new_page();
+    void* l1 = vms_new_page();
+    void* l0 = vms_new_page();
+    void* p0 = vms_new_page();
+    void* p1 = vms_new_page();
+
+    void* virtual_address_1 = (void*) 0xABC123;
+    void* virtual_address_2 = (void*) 0xABD123;
+    uint64_t* l2_entry = vms_page_table_pte_entry(l2, virtual_address_1, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+
+    uint64_t* l1_entry = vms_page_table_pte_entry(l1, virtual_address_1, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(l0));
+    vms_pte_valid_set(l1_entry);
+
+    uint64_t* l0_entry_1 = vms_page_table_pte_entry(l0, virtual_address_1, 0);
+    vms_pte_set_ppn(l0_entry_1, vms_page_to_ppn(p0));
+    vms_pte_valid_set(l0_entry_1);
+    vms_pte_read_set(l0_entry_1);
+    vms_pte_write_set(l0_entry_1);
+
+    uint64_t* l0_entry_2 = vms_page_table_pte_entry(l0, virtual_address_2, 0);
+    vms_pte_set_ppn(l0_entry_2, vms_page_to_ppn(p1));
+    vms_pte_valid_set(l0_entry_2);
+    vms_pte_read_set(l0_entry_2);
+    vms_pte_write_set(l0_entry_2);
+
+    vms_set_root_page_table(l2);
+    vms_write(virtual_address_1, 1);
+    vms_write(virtual_address_2, 2);
+
+    /* Only the child's L2 is allocated, the L1 and L0 tables are shared */
+    void* forked_l2 = vms_fork_copy_on_write_shared();
+    assert(forked_l2 != l2);
+    assert(vms_get_used_pages() == 6);
+
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(virtual_address_1) == 1);
+    assert(vms_read(virtual_address_2) == 2);
+    assert(vms_get_used_pages() == 6);
+
+    /* The first write copies the L1, the L0 and the data page */
+    vms_write(virtual_address_1, 3);
+    assert(vms_get_used_pages() == 9);
+    assert(vms_read(virtual_address_1) == 3);
+    vms_write(virtual_address_2, 4);
+    assert(vms_get_used_pages() == 10);
+
+    /* The parent is now the only user of its tables and pages */
+    vms_set_root_page_table(l2);
+    assert(vms_read(virtual_address_1) == 1);
+    assert(vms_read(virtual_address_2) == 2);
+    vms_write(virtual_address_1, 5);
+    vms_write(virtual_address_2, 6);
+    assert(vms_get_used_pages() == 10);
+    assert(vms_read(virtual_address_1) == 5);
+    assert(vms_read(virtual_address_2) == 6);
+
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(virtual_address_1) == 3);
+    assert(vms_read(virtual_address_2) == 4);
+
+    /* Forking a child that shares with two address spaces */
+    void* grandchild_l2 = vms_fork_copy_on_write_shared();
+    void* sibling_l2 = vms_fork_copy_on_write_shared();
+    assert(vms_get_used_pages() == 12);
+    vms_set_root_page_table(sibling_l2);
+    vms_write(virtual_address_1, 7);
+    assert(vms_get_used_pages() == 15);
+    vms_set_root_page_table(grandchild_l2);
+    assert(vms_read(virtual_address_1) == 3);
+    vms_write(virtual_address_2, 8);
+    assert(vms_get_used_pages() == 18);
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(virtual_address_1) == 3);
+    assert(vms_read(virtual_address_2) == 4);
+    vms_set_root_page_table(sibling_l2);
+    assert(vms_read(virtual_address_1) == 7);
+    assert(vms_read(virtual_address_2) == 4);
+    vms_set_root_page_table(l2);
+    assert(vms_read(virtual_address_1) == 5);
+}
@@ -0,0 +1,68 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <errno.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(4096) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    int tables = vms_get_levels() - 1; //below the root on the way to a page
+
+    /* Reserving 1 GiB only records the region */
+    uint8_t* base = (uint8_t*) 0x40000000;
+    size_t length = (size_t) 1 << 30;
+    assert(vms_map_range(base, length, VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    assert(vms_get_used_pages() == 1);
+
+    assert(vms_map_range(base + PAGE_SIZE, PAGE_SIZE, VMS_PROT_READ, 0) == EEXIST);
+    assert(vms_map_range(base - 1, PAGE_SIZE, VMS_PROT_READ, 0) == EINVAL);
+    assert(vms_map_range(base - PAGE_SIZE, 0, VMS_PROT_READ, 0) == EINVAL);
+
+    /* First touch allocates the tables down to the L0 and a zeroed data
+       page */
+    uint8_t* far = base + length - PAGE_SIZE;
+    assert(vms_read(far) == 0);
+    assert(vms_get_used_pages() == 1 + tables + 1);
+    vms_write(far + 8, 5);
+    assert(vms_get_used_pages() == 1 + tables + 1);
+    vms_write(far - PAGE_SIZE, 6);
+    assert(vms_get_used_pages() == 1 + tables + 2);
+    /* Same L1, but a new L0 */
+    vms_write(base, 7);
+    int used = 1 + tables + 4;
+    assert(vms_get_used_pages() == used);
+
+    /* Children inherit the region, and populate their own pages */
+    void* forked_l2 = vms_fork_copy_on_write_shared();
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(far + 8) == 5);
+    assert(vms_read(base + PAGE_SIZE) == 0);
+    assert(vms_get_used_pages() == used + 1 + tables + 1);
+    vms_set_root_page_table(l2);
+    assert(vms_read(base) == 7);
+    vms_write(base + PAGE_SIZE, 8);
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(base + PAGE_SIZE) == 0);
+    vms_destroy_address_space(forked_l2);
+
+    /* Unmapped pages of a region come back zeroed */
+    vms_set_root_page_table(l2);
+    vms_unmap(far + 8);
+    assert(vms_read(far + 8) == 0);
+
+    /* Populated regions are backed immediately */
+    used = vms_get_used_pages();
+    uint8_t* eager = (uint8_t*) 0x80000000;
+    assert(vms_map_range(eager, 16 * PAGE_SIZE, VMS_PROT_READ,
+                         VMS_MAP_POPULATE) == 0);
+    assert(vms_get_used_pages() == used + 2 + 16);
+    assert(vms_read(eager + 15 * PAGE_SIZE) == 0);
+    assert(vms_get_used_pages() == used + 2 + 16);
+
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+}
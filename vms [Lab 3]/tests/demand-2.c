@@ -0,0 +1,20 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <errno.h>
+
+int expected_exit_status() { return EFAULT; }
+
+void test() {
+    vms_init();
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+
+    uint8_t* base = (uint8_t*) 0x40000000;
+    assert(vms_map_range(base, 4 * PAGE_SIZE, VMS_PROT_READ, 0) == 0);
+    assert(vms_read(base + 3 * PAGE_SIZE) == 0);
+
+    /* Outside the region, this should generate a fatal page fault */
+    vms_read(base + 4 * PAGE_SIZE);
+}
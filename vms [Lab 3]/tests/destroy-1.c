@@ -0,0 +1,76 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    vms_init();
+
+    void* l2 = vms_new_page();
+    void* l1 = vms_new_page();
+    void* l0 = vms_new_page();
+    void* p0 = vms_new_page();
+    void* p1 = vms_new_page();
+
+    void* virtual_address_1 = (void*) 0xABC123;
+    void* virtual_address_2 = (void*) 0xABD123;
+    uint64_t* l2_entry = vms_page_table_pte_entry(l2, virtual_address_1, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+
+    uint64_t* l1_entry = vms_page_table_pte_entry(l1, virtual_address_1, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(l0));
+    vms_pte_valid_set(l1_entry);
+
+    uint64_t* l0_entry_1 = vms_page_table_pte_entry(l0, virtual_address_1, 0);
+    vms_pte_set_ppn(l0_entry_1, vms_page_to_ppn(p0));
+    vms_pte_valid_set(l0_entry_1);
+    vms_pte_read_set(l0_entry_1);
+    vms_pte_write_set(l0_entry_1);
+
+    uint64_t* l0_entry_2 = vms_page_table_pte_entry(l0, virtual_address_2, 0);
+    vms_pte_set_ppn(l0_entry_2, vms_page_to_ppn(p1));
+    vms_pte_valid_set(l0_entry_2);
+    vms_pte_read_set(l0_entry_2);
+
+    vms_set_root_page_table(l2);
+    vms_write(virtual_address_1, 1);
+    int baseline = vms_get_used_pages();
+
+    /* Fork, write in the child and exit, far more times than the pool
+       could hold without reclaiming */
+    for (int i = 0; i < 5000; ++i) {
+        void* child_l2;
+        switch (i % 3) {
+        case 0: child_l2 = vms_fork_copy(); break;
+        case 1: child_l2 = vms_fork_copy_on_write(); break;
+        default: child_l2 = vms_fork_copy_on_write_shared(); break;
+        }
+        assert(child_l2 != NULL);
+
+        vms_set_root_page_table(child_l2);
+        assert(vms_read(virtual_address_1) == i + 1);
+        vms_write(virtual_address_1, i + 2);
+        assert(vms_read(virtual_address_2) == 0);
+
+        vms_set_root_page_table(l2);
+        assert(vms_read(virtual_address_1) == i + 1);
+        vms_destroy_address_space(child_l2);
+        assert(vms_get_used_pages() == baseline);
+
+        vms_write(virtual_address_1, i + 2);
+        assert(vms_get_used_pages() == baseline);
+    }
+
+    /* The parent can exit while a COW child lives on */
+    void* child_l2 = vms_fork_copy_on_write_shared();
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == baseline);
+    vms_set_root_page_table(child_l2);
+    vms_write(virtual_address_1, 42);
+    assert(vms_get_used_pages() == baseline);
+    assert(vms_read(virtual_address_1) == 42);
+    vms_destroy_address_space(child_l2);
+    assert(vms_get_used_pages() == 0);
+}
@@ -0,0 +1,110 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(16) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+
+    uint8_t* base = (uint8_t*) 0x40000000;
+    assert(vms_map_range(base, 8 * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    for (int i = 0; i < 4; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+    }
+    for (int i = 4; i < 8; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE) == 0);
+    }
+
+    /* Reads set the accessed bit, writes also set the dirty bit */
+    void* addresses[8];
+    assert(vms_scan_dirty(addresses, 8, 0) == 4);
+    for (int i = 0; i < 4; ++i) {
+        assert(addresses[i] == base + i * PAGE_SIZE);
+    }
+    assert(vms_scan_accessed(NULL, 0, 1) == 8);
+    assert(vms_scan_accessed(NULL, 0, 0) == 0);
+    assert(vms_read(base + 5 * PAGE_SIZE) == 0);
+    assert(vms_scan_accessed(addresses, 1, 0) == 1);
+    assert(addresses[0] == base + 5 * PAGE_SIZE);
+
+    /* Clearing dirty bits starts a new interval */
+    assert(vms_scan_dirty(addresses, 2, 1) == 4);
+    assert(vms_scan_dirty(NULL, 0, 0) == 0);
+    vms_write(base + 6 * PAGE_SIZE, 6);
+    assert(vms_scan_dirty(addresses, 8, 0) == 1);
+    assert(addresses[0] == base + 6 * PAGE_SIZE);
+
+    /* Clean pages are evicted without writing them back */
+    assert(vms_swap_enable("vms-dirty-1.swap", 256) == 0);
+    unlink("vms-dirty-1.swap");
+    uint8_t* data = (uint8_t*) 0x80000000;
+    int pages = 64;
+    assert(vms_map_range(data, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(data + i * PAGE_SIZE, i);
+    }
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < pages; ++i) {
+            assert(vms_read(data + i * PAGE_SIZE) == i);
+        }
+    }
+
+    vms_swap_reset_stats();
+    for (int i = 0; i < pages; ++i) {
+        assert(vms_read(data + i * PAGE_SIZE) == i);
+    }
+    struct vms_swap_stats stats;
+    vms_swap_get_stats(&stats);
+    assert(stats.evictions > 0);
+    assert(stats.swap_writes == 0);
+
+    /* Writing a page again makes it dirty, so it is written on eviction */
+    vms_write(data, 100);
+    for (int i = 1; i < pages; ++i) {
+        assert(vms_read(data + i * PAGE_SIZE) == i);
+    }
+    assert(vms_read(data) == 100);
+    vms_swap_get_stats(&stats);
+    assert(stats.swap_writes == 1);
+
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+    assert(vms_swap_disable() == 0);
+
+    /* Splitting a written huge page keeps its bits in every 4 KiB entry */
+    assert(vms_init_pool(2048) == 0);
+    l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    assert(vms_map_range(base, 2 * HUGE_PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    assert(vms_read(base) == 0); //the tables down to level 1
+    uint8_t* huge = base + HUGE_PAGE_SIZE;
+    void* page_table = l2;
+    for (int level = vms_get_levels() - 1; level > 1; --level) {
+        uint64_t* entry = vms_page_table_pte_entry(page_table, huge, level);
+        page_table = vms_ppn_to_page(vms_pte_get_ppn(entry));
+    }
+    uint64_t* huge_entry = vms_page_table_pte_entry(page_table, huge, 1);
+    vms_pte_set_ppn(huge_entry, vms_page_to_ppn(vms_new_huge_page()));
+    vms_pte_valid_set(huge_entry);
+    vms_pte_huge_set(huge_entry);
+    vms_pte_read_set(huge_entry);
+    vms_pte_write_set(huge_entry);
+    assert(vms_scan_accessed(NULL, 0, 1) == 1);
+    vms_write(huge + 8, 5);
+    assert(vms_scan_dirty(NULL, 0, 0) == 1);
+
+    vms_unmap(huge + PAGE_SIZE);
+    assert(vms_scan_dirty(NULL, 0, 0) == HUGE_PAGE_SIZE / PAGE_SIZE - 1);
+    assert(vms_scan_accessed(NULL, 0, 0) == HUGE_PAGE_SIZE / PAGE_SIZE - 1);
+    assert(vms_read(huge + 8) == 5);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+}
@@ -0,0 +1,109 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int expected_exit_status() { return 0; }
+
+static uint8_t* const private = (uint8_t*) 0x40000000;
+static uint8_t* const shared = (uint8_t*) 0x80000000;
+
+static int file_int(int fd, int page, int index) {
+    int value;
+    assert(pread(fd, &value, sizeof(int), page * PAGE_SIZE + index * sizeof(int)) == sizeof(int));
+    return value;
+}
+
+void test() {
+    assert(vms_init_pool(256) == 0);
+
+    /* Two and a half pages of data */
+    int fd = open("vms-file-1.data", O_RDWR | O_CREAT | O_TRUNC, 0600);
+    assert(fd != -1);
+    unlink("vms-file-1.data"); //the open descriptor keeps it alive
+    int values = 5 * PAGE_SIZE / 2 / sizeof(int);
+    for (int i = 0; i < values; ++i) {
+        assert(write(fd, &i, sizeof(int)) == sizeof(int));
+    }
+    int per_page = PAGE_SIZE / sizeof(int);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    vms_file_reset_stats();
+    assert(vms_map_file(private, 4 * PAGE_SIZE, VMS_PROT_READ | VMS_PROT_WRITE, 0, fd, 0) == 0);
+    assert(vms_map_file(shared, 3 * PAGE_SIZE, VMS_PROT_READ | VMS_PROT_WRITE,
+                        VMS_MAP_SHARED, fd, PAGE_SIZE) == 0);
+    assert(vms_map_file(shared + 8 * PAGE_SIZE, PAGE_SIZE, VMS_PROT_READ, 0, fd, 1) == EINVAL);
+
+    /* Pages are read on first touch only */
+    struct vms_file_stats stats;
+    vms_file_get_stats(&stats);
+    assert(stats.page_reads == 0);
+    assert(vms_read(private + 5 * sizeof(int)) == 5);
+    assert(vms_read(private + PAGE_SIZE) == per_page);
+    vms_file_get_stats(&stats);
+    assert(stats.page_reads == 2);
+    assert(vms_read(private + 2 * PAGE_SIZE + 4) == 2 * per_page + 1);
+    assert(vms_read(private + 2 * PAGE_SIZE + PAGE_SIZE / 2) == 0); //past the end
+    assert(vms_read(private + 3 * PAGE_SIZE) == 0);
+
+    /* Private writes never reach the file */
+    vms_write(private, -1);
+    assert(vms_sync(private, 4 * PAGE_SIZE) == 0);
+    vms_file_get_stats(&stats);
+    assert(stats.page_writes == 0);
+    assert(file_int(fd, 0, 0) == 0);
+
+    /* Shared writes from a child reach the parent, and the file on sync */
+    assert(vms_read(shared) == per_page);
+    void* child = vms_fork_copy_on_write();
+    vms_set_root_page_table(child);
+    vms_write(shared, -2);
+    vms_write(shared + PAGE_SIZE + 8, -3); //first touched by the child
+    vms_set_root_page_table(l2);
+    assert(vms_read(shared) == -2);
+    assert(vms_read(shared + PAGE_SIZE + 8) == -3);
+    assert(file_int(fd, 1, 0) == per_page);
+
+    vms_set_root_page_table(child);
+    vms_file_reset_stats();
+    assert(vms_sync(shared, 3 * PAGE_SIZE) == 0);
+    vms_file_get_stats(&stats);
+    assert(stats.page_writes == 2);
+    assert(file_int(fd, 1, 0) == -2);
+    assert(file_int(fd, 2, 2) == -3);
+    assert(file_int(fd, 2, 3) == 2 * per_page + 3);
+    assert(vms_sync(shared, 3 * PAGE_SIZE) == 0); //clean now
+    vms_file_get_stats(&stats);
+    assert(stats.page_writes == 2);
+
+    /* Writes of an address space that went away are kept for the next
+       sync from another */
+    vms_write(shared + PAGE_SIZE + 16, -4);
+    vms_destroy_address_space(child);
+    vms_set_root_page_table(l2);
+    assert(file_int(fd, 2, 4) == 2 * per_page + 4);
+    vms_file_reset_stats();
+    assert(vms_sync(shared, 3 * PAGE_SIZE) == 0);
+    vms_file_get_stats(&stats);
+    assert(stats.page_writes == 1);
+    assert(file_int(fd, 2, 4) == -4);
+
+    /* So are those of an unmapped page */
+    vms_write(shared, -5);
+    vms_unmap(shared);
+    assert(vms_sync(shared, 3 * PAGE_SIZE) == 0);
+    assert(file_int(fd, 1, 0) == -5);
+
+    /* The last address space mapping the file writes back on destroy */
+    vms_write(shared + 4, -6);
+    assert(vms_read(private) == -1);
+    int reader = dup(fd);
+    close(fd); //the mappings hold their own descriptors
+    vms_destroy_address_space(l2);
+    assert(file_int(reader, 1, 1) == -6);
+    close(reader);
+    assert(vms_get_used_pages() == 0);
+}
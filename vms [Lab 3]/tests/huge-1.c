@@ -0,0 +1,103 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(4096) == 0);
+
+    void* l2 = vms_new_page();
+    void* l1 = vms_new_page();
+    void* huge = vms_new_huge_page();
+    assert(huge != NULL);
+    assert(vms_get_page_index(huge) % 512 == 0);
+    assert(vms_get_used_pages() == 2 + 512);
+
+    uint8_t* base = (uint8_t*) 0x40000000;
+    uint64_t* l2_entry = vms_page_table_pte_entry(l2, base, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+
+    /* One L1 entry maps 2 MiB, no L0 table is needed */
+    uint64_t* l1_entry = vms_page_table_pte_entry(l1, base, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(huge));
+    vms_pte_valid_set(l1_entry);
+    vms_pte_huge_set(l1_entry);
+    vms_pte_read_set(l1_entry);
+    vms_pte_write_set(l1_entry);
+
+    vms_set_root_page_table(l2);
+    void* first = base;
+    void* middle = base + 300 * PAGE_SIZE + 12;
+    void* last = base + HUGE_PAGE_SIZE - sizeof(int);
+    vms_write(first, 1);
+    vms_write(middle, 2);
+    vms_write(last, 3);
+    assert(*(int*) ((uint8_t*) huge + 300 * PAGE_SIZE + 12) == 2);
+    assert(vms_read(last) == 3);
+
+    /* Eager fork copies the whole huge page */
+    void* copy_l2 = vms_fork_copy();
+    assert(vms_get_used_pages() == 2 * (2 + 512));
+    vms_set_root_page_table(copy_l2);
+    assert(vms_read(middle) == 2);
+    vms_write(middle, 20);
+    vms_set_root_page_table(l2);
+    assert(vms_read(middle) == 2);
+    vms_destroy_address_space(copy_l2);
+    assert(vms_get_used_pages() == 2 + 512);
+
+    /* COW fork shares it, and a write splits it and copies one page */
+    void* forked_l2 = vms_fork_copy_on_write();
+    assert(vms_get_used_pages() == 2 + 512 + 2);
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(middle) == 2);
+    vms_write(middle, 4);
+    assert(vms_get_used_pages() == 2 + 512 + 2 + 2);
+    assert(vms_read(middle) == 4);
+    assert(vms_read(first) == 1);
+    assert(vms_read(last) == 3);
+
+    vms_set_root_page_table(l2);
+    assert(vms_read(middle) == 2);
+    /* The parent still shares other pages, so it splits too but reuses the
+       page the child already copied away from */
+    vms_write(middle, 5);
+    assert(vms_get_used_pages() == 2 + 512 + 2 + 2 + 1);
+    assert(vms_read(middle) == 5);
+    vms_write(first, 6);
+    assert(vms_get_used_pages() == 2 + 512 + 2 + 2 + 1 + 1);
+
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(first) == 1);
+    assert(vms_read(middle) == 4);
+
+    vms_destroy_address_space(forked_l2);
+    vms_set_root_page_table(l2);
+    assert(vms_get_used_pages() == 2 + 512 + 1);
+    vms_unmap(last);
+    assert(vms_get_used_pages() == 2 + 512);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+
+    /* A sole owner of a COW huge page writes to it in place */
+    l2 = vms_new_page();
+    l1 = vms_new_page();
+    huge = vms_new_huge_page();
+    l2_entry = vms_page_table_pte_entry(l2, base, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+    l1_entry = vms_page_table_pte_entry(l1, base, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(huge));
+    vms_pte_valid_set(l1_entry);
+    vms_pte_huge_set(l1_entry);
+    vms_pte_read_set(l1_entry);
+    vms_pte_write_set(l1_entry);
+    vms_set_root_page_table(l2);
+    forked_l2 = vms_fork_copy_on_write_shared();
+    vms_destroy_address_space(forked_l2);
+    vms_write(middle, 7);
+    assert(vms_pte_huge(l1_entry));
+    assert(vms_get_used_pages() == 2 + 512);
+}
@@ -0,0 +1,59 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <errno.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(256) == 0);
+
+    void* root = vms_new_page();
+    vms_set_root_page_table(root);
+    int levels = vms_get_levels();
+    int tables = levels - 1; //below the root on the way to a page
+
+    /* The last pages of the address space use the last entry of a table
+       at every level */
+    uint8_t* top = (uint8_t*) ((uint64_t) 1 << (12 + 9 * levels));
+    int pages = 4;
+    uint8_t* base = top - pages * PAGE_SIZE;
+    assert(vms_map_range(top, PAGE_SIZE, VMS_PROT_READ, 0) == EINVAL);
+    assert(vms_map_range(base, pages * PAGE_SIZE + PAGE_SIZE, VMS_PROT_READ, 0) == EINVAL);
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+    }
+    assert(vms_get_used_pages() == 1 + tables + pages);
+
+    /* A low page shares no table with them but the root */
+    uint8_t* low = (uint8_t*) 0x40000000;
+    assert(vms_map_range(low, PAGE_SIZE, VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    vms_write(low, 100);
+    int used = 1 + 2 * tables + pages + 1;
+    assert(vms_get_used_pages() == used);
+
+    /* The fork copies every table and shares the data pages */
+    void* child = vms_fork_copy_on_write();
+    assert(vms_get_used_pages() == used + 1 + 2 * tables);
+    vms_set_root_page_table(child);
+    for (int i = 0; i < pages; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE) == i);
+    }
+    vms_write(top - 4, -1);
+    vms_write(low, -100);
+    assert(vms_get_used_pages() == used + 1 + 2 * tables + 2);
+    assert(vms_read(top - 4) == -1);
+    assert(vms_read(base + (pages - 1) * PAGE_SIZE) == pages - 1);
+
+    vms_set_root_page_table(root);
+    assert(vms_read(top - 4) == 0);
+    assert(vms_read(base + (pages - 1) * PAGE_SIZE) == pages - 1);
+    assert(vms_read(low) == 100);
+
+    vms_destroy_address_space(child);
+    assert(vms_get_used_pages() == used);
+    vms_destroy_address_space(root);
+    assert(vms_get_used_pages() == 0);
+}
@@ -0,0 +1,79 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(256) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    uint8_t* base = (uint8_t*) 0x40000000;
+    uint8_t* readonly = (uint8_t*) 0x80000000;
+    int pages = 64;
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE,
+                         VMS_MAP_POPULATE) == 0);
+    assert(vms_map_range(readonly, 4 * PAGE_SIZE, VMS_PROT_READ,
+                         VMS_MAP_POPULATE) == 0);
+    /* 32 zero pages, 16 pages holding 5 and 16 distinct ones */
+    for (int i = 32; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, i < 48 ? 5 : i);
+    }
+    void* copy_l2 = vms_fork_copy();
+    int used = vms_get_used_pages();
+
+    /* Both address spaces end up with one zero page, one page of 5s and
+       the 16 distinct pages */
+    void* roots[] = {l2, copy_l2};
+    struct vms_merge_stats stats;
+    assert(vms_merge_pages(roots, 2, &stats) == 0);
+    int data_pages = 2 * (pages + 4);
+    assert(stats.scanned == (uint64_t) data_pages);
+    assert(stats.merged == (uint64_t) data_pages - 18);
+    assert(stats.zero_pages == 2 * (32 + 4) - 1);
+    assert(stats.reclaimed == stats.merged);
+    assert(vms_get_used_pages() == used - (int) stats.reclaimed);
+
+    /* Writes break the sharing again, in either address space */
+    vms_set_root_page_table(copy_l2);
+    vms_write(base, 1);
+    vms_write(base + 40 * PAGE_SIZE + 4, 6);
+    vms_write(base + 50 * PAGE_SIZE, -50);
+    assert(vms_read(readonly) == 0);
+    vms_set_root_page_table(l2);
+    assert(vms_read(base) == 0);
+    assert(vms_read(base + PAGE_SIZE) == 0);
+    assert(vms_read(base + 40 * PAGE_SIZE + 4) == 0);
+    assert(vms_read(base + 50 * PAGE_SIZE) == 50);
+    vms_write(base + 33 * PAGE_SIZE, 33);
+    assert(vms_read(base + 34 * PAGE_SIZE) == 5);
+    vms_set_root_page_table(copy_l2);
+    assert(vms_read(base) == 1);
+    assert(vms_read(base + 33 * PAGE_SIZE) == 5);
+    assert(vms_read(base + 40 * PAGE_SIZE + 4) == 6);
+    assert(vms_read(base + 50 * PAGE_SIZE) == -50);
+    assert(vms_get_used_pages() == used - (int) stats.reclaimed + 4);
+
+    /* The first page seen of each class was merged into as well */
+    vms_set_root_page_table(l2);
+    vms_write(base, 7);
+    vms_write(base + 32 * PAGE_SIZE, 8);
+    assert(vms_read(base + PAGE_SIZE) == 0);
+    assert(vms_read(readonly) == 0);
+    assert(vms_read(base + 32 * PAGE_SIZE) == 8);
+    assert(vms_read(base + 34 * PAGE_SIZE) == 5);
+    vms_set_root_page_table(copy_l2);
+    assert(vms_read(base + PAGE_SIZE) == 0);
+    assert(vms_read(base + 32 * PAGE_SIZE) == 5);
+
+    /* Merging again only finds what the writes left identical */
+    assert(vms_merge_pages(NULL, 0, &stats) == 0);
+    assert(stats.merged == 0);
+
+    vms_destroy_address_space(copy_l2);
+    vms_set_root_page_table(l2);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+}
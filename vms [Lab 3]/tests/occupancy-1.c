@@ -0,0 +1,84 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    vms_init();
+
+    void* l2 = vms_new_page();
+    void* l1 = vms_new_page();
+    void* l0 = vms_new_page();
+
+    void* base = (void*) 0x40000000;
+    uint64_t* l2_entry = vms_page_table_pte_entry(l2, base, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+
+    uint64_t* l1_entry = vms_page_table_pte_entry(l1, base, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(l0));
+    vms_pte_valid_set(l1_entry);
+
+    assert(vms_page_table_next_valid(l0, 0) == 512);
+    assert(vms_page_table_valid_count(l0) == 0);
+
+    int indices[] = {0, 63, 64, 300, 511};
+    for (int i = 0; i < 5; ++i) {
+        uint64_t* entry = vms_page_table_pte_entry_from_index(l0, indices[i]);
+        vms_pte_set_ppn(entry, vms_page_to_ppn(vms_new_page()));
+        vms_pte_valid_set(entry);
+        vms_pte_read_set(entry);
+        vms_pte_write_set(entry);
+    }
+    assert(vms_page_table_valid_count(l0) == 5);
+    assert(vms_page_table_valid_count(l1) == 1);
+    assert(vms_page_table_valid_count(l2) == 1);
+
+    int found = 0;
+    for (int i = vms_page_table_next_valid(l0, 0);
+         i < 512;
+         i = vms_page_table_next_valid(l0, i + 1)) {
+        assert(i == indices[found]);
+        ++found;
+    }
+    assert(found == 5);
+    assert(vms_page_table_next_valid(l0, 65) == 300);
+
+    /* Clearing the valid bit removes the entry from walks */
+    uint64_t* entry_300 = vms_page_table_pte_entry_from_index(l0, 300);
+    vms_pte_valid_clear(entry_300);
+    assert(vms_page_table_next_valid(l0, 65) == 511);
+
+    vms_set_root_page_table(l2);
+    for (int i = 0; i < 5; ++i) {
+        if (indices[i] != 300) {
+            vms_write((uint8_t*) base + indices[i] * PAGE_SIZE, indices[i]);
+        }
+    }
+
+    int used = vms_get_used_pages();
+    void* forked_l2 = vms_fork_copy();
+    assert(vms_get_used_pages() == used + 3 + 4);
+    void* forked_l0 = vms_ppn_to_page(vms_pte_get_ppn(
+        vms_page_table_pte_entry(
+            vms_ppn_to_page(vms_pte_get_ppn(
+                vms_page_table_pte_entry(forked_l2, base, 2))),
+            base,
+            1)));
+    assert(vms_page_table_valid_count(forked_l0) == 4);
+
+    vms_set_root_page_table(forked_l2);
+    for (int i = 0; i < 5; ++i) {
+        if (indices[i] != 300) {
+            assert(vms_read((uint8_t*) base + indices[i] * PAGE_SIZE)
+                   == indices[i]);
+        }
+    }
+
+    /* Freed table pages start with an empty bitmap */
+    vms_destroy_address_space(forked_l2);
+    assert(vms_get_used_pages() == used);
+    void* table = vms_new_page();
+    assert(vms_page_table_valid_count(table) == 0);
+}
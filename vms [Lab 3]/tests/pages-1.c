@@ -0,0 +1,33 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    vms_init();
+
+    void* pages[256];
+    for (int i = 0; i < 256; ++i) {
+        pages[i] = vms_new_page();
+        assert(vms_get_page_index(pages[i]) == i);
+    }
+    assert(vms_get_used_pages() == 256);
+
+    /* Freed pages are handed out again, lowest index first */
+    vms_free_page(pages[200]);
+    vms_free_page(pages[3]);
+    vms_free_page(pages[64]);
+    assert(vms_get_used_pages() == 253);
+    assert(vms_new_page() == pages[3]);
+    assert(vms_new_page() == pages[64]);
+    assert(vms_new_page() == pages[200]);
+    assert(vms_get_used_pages() == 256);
+
+    /* Freed pages come back zeroed */
+    int* data = pages[10];
+    data[0] = 42;
+    vms_free_page(pages[10]);
+    assert(vms_new_page() == pages[10]);
+    assert(data[0] == 0);
+}
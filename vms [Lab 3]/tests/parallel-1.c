@@ -0,0 +1,68 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(8192) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+
+    /* Four level 0 tables and a huge page to share out between workers */
+    uint8_t* base = (uint8_t*) 0x40000000;
+    int pages = 4 * 512;
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE,
+                         VMS_MAP_POPULATE) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+    }
+
+    uint8_t* huge = base + 8 * HUGE_PAGE_SIZE;
+    void* l1 = vms_ppn_to_page(vms_pte_get_ppn(vms_page_table_pte_entry(l2, huge, 2)));
+    uint64_t* huge_entry = vms_page_table_pte_entry(l1, huge, 1);
+    vms_pte_set_ppn(huge_entry, vms_page_to_ppn(vms_new_huge_page()));
+    vms_pte_valid_set(huge_entry);
+    vms_pte_huge_set(huge_entry);
+    vms_pte_read_set(huge_entry);
+    vms_pte_write_set(huge_entry);
+    vms_write(huge + HUGE_PAGE_SIZE - PAGE_SIZE, 42);
+
+    int used = vms_get_used_pages();
+    assert(used == 1 + 1 + 4 + pages + 512);
+
+    void* forked_l2 = vms_fork_copy_parallel(4);
+    assert(forked_l2 != NULL);
+    assert(vms_get_used_pages() == 2 * used);
+
+    vms_set_root_page_table(forked_l2);
+    for (int i = 0; i < pages; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE) == i);
+        vms_write(base + i * PAGE_SIZE, -i);
+    }
+    assert(vms_read(huge + HUGE_PAGE_SIZE - PAGE_SIZE) == 42);
+    vms_write(huge, 7);
+    assert(vms_get_used_pages() == 2 * used);
+
+    /* The parent keeps its own pages */
+    vms_set_root_page_table(l2);
+    for (int i = 0; i < pages; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE) == i);
+    }
+    assert(vms_read(huge) == 0);
+
+    /* Regions are inherited as well */
+    vms_destroy_address_space(forked_l2);
+    assert(vms_get_used_pages() == used);
+    vms_unmap(base);
+    forked_l2 = vms_fork_copy_parallel(2);
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(base) == 0);
+
+    vms_destroy_address_space(forked_l2);
+    vms_set_root_page_table(l2);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+}
@@ -0,0 +1,47 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(16384) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    uint8_t* base = (uint8_t*) 0x40000000;
+    int pages = 4 * 512;
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE,
+                         VMS_MAP_POPULATE) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+    }
+
+    /* Copies of pages still copy-on-write in the forked address space
+       are private, so they are writable */
+    void* cow_l2 = vms_fork_copy_on_write();
+    vms_set_root_page_table(cow_l2);
+    vms_write(base, -1); //one page copied already, the rest still shared
+    void* forks[2] = {vms_fork_copy_parallel(4), vms_fork_copy()};
+    for (int f = 0; f < 2; ++f) {
+        assert(forks[f] != NULL);
+        vms_set_root_page_table(forks[f]);
+        assert(vms_read(base) == -1);
+        for (int i = 1; i < pages; ++i) {
+            assert(vms_read(base + i * PAGE_SIZE) == i);
+            vms_write(base + i * PAGE_SIZE, -i);
+        }
+        vms_destroy_address_space(forks[f]);
+    }
+
+    vms_set_root_page_table(cow_l2);
+    for (int i = 1; i < pages; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE) == i);
+    }
+    vms_destroy_address_space(cow_l2);
+    vms_set_root_page_table(l2);
+    assert(vms_read(base) == 0);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+}
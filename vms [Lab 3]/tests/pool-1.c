@@ -0,0 +1,68 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <errno.h>
+
+int expected_exit_status() { return 0; }
+
+static void* map_page(void* l2, void* virtual_address) {
+    void* l1 = vms_new_page();
+    void* l0 = vms_new_page();
+    void* p0 = vms_new_page();
+
+    uint64_t* l2_entry = vms_page_table_pte_entry(l2, virtual_address, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+
+    uint64_t* l1_entry = vms_page_table_pte_entry(l1, virtual_address, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(l0));
+    vms_pte_valid_set(l1_entry);
+
+    uint64_t* l0_entry = vms_page_table_pte_entry(l0, virtual_address, 0);
+    vms_pte_set_ppn(l0_entry, vms_page_to_ppn(p0));
+    vms_pte_valid_set(l0_entry);
+    vms_pte_read_set(l0_entry);
+    vms_pte_write_set(l0_entry);
+    return p0;
+}
+
+void test() {
+    assert(vms_init_pool(0) == EINVAL);
+
+    /* 4 GiB of simulated physical memory, only touched pages are backed */
+    assert(vms_init_pool(1 << 20) == 0);
+    assert(vms_get_max_pages() == 1 << 20);
+    for (int i = 0; i < 600000; ++i) {
+        assert(vms_new_page() != NULL);
+    }
+    assert(vms_get_used_pages() == 600000);
+
+    /* Past 2 GiB into the pool */
+    void* l2 = vms_new_page();
+    void* virtual_address = (void*) 0xABC123;
+    void* p0 = map_page(l2, virtual_address);
+    assert(vms_get_page_index(p0) == 600003);
+    assert(vms_get_page_pointer(600003) == p0);
+    vms_set_root_page_table(l2);
+    vms_write(virtual_address, 7);
+    assert(vms_read(virtual_address) == 7);
+
+    /* The largest pool reserves its metadata like its pages */
+    assert(vms_init_pool((size_t) 1 << 28) == 0);
+    assert(vms_get_max_pages() == (size_t) 1 << 28);
+    assert(vms_init_pool(((size_t) 1 << 28) + 1) == EINVAL);
+
+    /* Exhausting a small pool is reported instead of exiting */
+    assert(vms_init_pool(5) == 0);
+    assert(vms_get_used_pages() == 0);
+    l2 = vms_new_page();
+    map_page(l2, virtual_address);
+    vms_set_root_page_table(l2);
+    vms_write(virtual_address, 1);
+    assert(vms_get_used_pages() == 4);
+    assert(vms_new_page() != NULL);
+    assert(vms_new_page() == NULL);
+    assert(errno == ENOMEM);
+    assert(vms_fork_copy() == NULL);
+    assert(vms_read(virtual_address) == 1);
+}
@@ -0,0 +1,84 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(256) == 0);
+    assert(vms_profile_enable(VMS_PROFILE_COUNTERS | VMS_PROFILE_TRACE, 4096) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    uint8_t* base = (uint8_t*) 0x40000000;
+    int pages = 16;
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+    }
+
+    struct vms_counters counters;
+    assert(vms_get_counters(l2, &counters) == 0);
+    assert(counters.translations == (uint64_t) pages);
+    assert(counters.faults == (uint64_t) pages);
+    assert(counters.cow_faults == 0);
+    /* The tables below the root, then one data page per fault */
+    int levels = vms_get_levels();
+    assert(counters.allocations == (uint64_t) (pages + levels - 1));
+    assert(counters.walks[0] == (uint64_t) pages);
+    assert(counters.walks[levels - 1] == counters.walks[0]);
+    assert(counters.fault_reasons[VMS_FAULT_NOT_PRESENT] == (uint64_t) pages);
+
+    void* forked_l2 = vms_fork_copy_on_write();
+    assert(vms_get_counters(l2, &counters) == 0);
+    assert(counters.forks == 1);
+    assert(counters.fork_nanoseconds > 0);
+
+    vms_set_root_page_table(forked_l2);
+    for (int i = 0; i < pages; i += 2) {
+        vms_write(base + i * PAGE_SIZE, -i);
+    }
+    assert(vms_get_counters(forked_l2, &counters) == 0);
+    assert(counters.cow_faults == (uint64_t) pages / 2);
+    assert(counters.fault_reasons[VMS_FAULT_COPY_ON_WRITE] == (uint64_t) pages / 2);
+    assert(counters.faults == counters.cow_faults);
+    assert(counters.copies == (uint64_t) pages / 2);
+    assert(counters.copied_bytes == (uint64_t) pages / 2 * PAGE_SIZE);
+    assert(counters.allocations == (uint64_t) pages / 2);
+    vms_reset_counters(forked_l2);
+    assert(vms_get_counters(forked_l2, &counters) == 0);
+    assert(counters.translations == 0);
+
+    /* The fork is in the trace, attributed to the parent */
+    struct vms_event events[4096];
+    size_t count = vms_trace_read(events, 4096);
+    assert(count > 0);
+    int forks = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0) assert(events[i].time >= events[i - 1].time);
+        if (events[i].type == VMS_EVENT_FORK) {
+            assert(events[i].space == (uint64_t) l2);
+            assert(events[i].address == (uint64_t) forked_l2);
+            ++forks;
+        }
+    }
+    assert(forks == 1);
+
+    /* Only the most recent events are kept */
+    assert(vms_trace_read(events, 3) == 3);
+    assert(events[2].type == VMS_EVENT_TRANSLATION);
+    assert(events[2].address == (uint64_t) (base + (pages - 2) * PAGE_SIZE));
+
+    assert(vms_trace_dump("vms-profile-1.trace") == 0);
+    unlink("vms-profile-1.trace");
+
+    vms_profile_disable();
+    assert(vms_trace_read(events, 4096) == 0);
+    vms_destroy_address_space(forked_l2);
+    vms_set_root_page_table(l2);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+}
@@ -0,0 +1,63 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define THREADS 4
+#define PAGES 64
+#define ROUNDS 2000
+
+int expected_exit_status() { return 0; }
+
+static uint8_t* const base = (uint8_t*) 0x40000000;
+static void* l2;
+static int started = 0;
+static int done = 0;
+
+/* Translations and faults record events while the trace is replaced */
+static void* worker(void* argument) {
+    int thread = (int) (intptr_t) argument;
+    vms_set_root_page_table(l2);
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        for (int i = 0; i < PAGES; ++i) {
+            vms_write(base + i * PAGE_SIZE + 4 * thread, i);
+            assert(vms_read(base + i * PAGE_SIZE + 4 * thread) == i);
+        }
+        if (!__atomic_load_n(&started, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+void test() {
+    assert(vms_init_pool(256) == 0);
+    l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    assert(vms_map_range(base, PAGES * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+
+    pthread_t threads[THREADS];
+    for (int t = 0; t < THREADS; ++t) {
+        assert(pthread_create(&threads[t], NULL, worker, (void*) (intptr_t) t) == 0);
+    }
+    while (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    for (int round = 0; round < ROUNDS; ++round) {
+        assert(vms_profile_enable(VMS_PROFILE_COUNTERS | VMS_PROFILE_TRACE, 1 + round % 7) == 0);
+        void* page = vms_new_page(); //recorded outside the MMU lock
+        vms_page_unref(page);
+        vms_profile_disable();
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    for (int t = 0; t < THREADS; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    struct vms_event events[8];
+    assert(vms_trace_read(events, 8) == 0);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+}
@@ -0,0 +1,52 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(8192) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    uint8_t* base = (uint8_t*) 0x40000000;
+    int pages = 4 * 512;
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE,
+                         VMS_MAP_POPULATE) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+    }
+
+    /* Workers allocate while the forking thread holds the MMU lock, and
+       their allocations count towards the address space being forked */
+    assert(vms_profile_enable(VMS_PROFILE_COUNTERS | VMS_PROFILE_TRACE, 8192) == 0);
+    void* forked_l2 = vms_fork_copy_parallel(4);
+    assert(forked_l2 != NULL);
+    struct vms_counters counters;
+    assert(vms_get_counters(l2, &counters) == 0);
+    int tables = vms_get_levels() - 2 + 4; //down to the four level 0 tables
+    assert(counters.allocations == (uint64_t) (1 + tables + pages));
+    assert(counters.forks == 1);
+
+    struct vms_event events[8192];
+    size_t count = vms_trace_read(events, 8192);
+    size_t allocations = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (events[i].type == VMS_EVENT_ALLOC) {
+            assert(events[i].space == (uint64_t) l2);
+            ++allocations;
+        }
+    }
+    assert(allocations == (size_t) (1 + tables + pages));
+    vms_profile_disable();
+
+    vms_set_root_page_table(forked_l2);
+    for (int i = 0; i < pages; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE) == i);
+    }
+    vms_destroy_address_space(forked_l2);
+    vms_set_root_page_table(l2);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+}
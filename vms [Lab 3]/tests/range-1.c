@@ -0,0 +1,77 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <string.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    vms_init();
+
+    void* l2 = vms_new_page();
+    void* l1 = vms_new_page();
+    void* l0 = vms_new_page();
+
+    uint8_t* base = (uint8_t*) 0xABC000;
+    uint64_t* l2_entry = vms_page_table_pte_entry(l2, base, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+
+    uint64_t* l1_entry = vms_page_table_pte_entry(l1, base, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(l0));
+    vms_pte_valid_set(l1_entry);
+
+    for (int i = 0; i < 4; ++i) {
+        uint64_t* l0_entry = vms_page_table_pte_entry(l0,
+                                                      base + i * PAGE_SIZE,
+                                                      0);
+        vms_pte_set_ppn(l0_entry, vms_page_to_ppn(vms_new_page()));
+        vms_pte_valid_set(l0_entry);
+        vms_pte_read_set(l0_entry);
+        vms_pte_write_set(l0_entry);
+    }
+
+    vms_set_root_page_table(l2);
+
+    /* Unaligned range spanning all four pages */
+    uint8_t buffer[2 * PAGE_SIZE + 100];
+    for (size_t i = 0; i < sizeof(buffer); ++i) {
+        buffer[i] = i * 7;
+    }
+    uint8_t* start = base + PAGE_SIZE - 50;
+    vms_write_range(start, buffer, sizeof(buffer));
+    assert(vms_read(base + PAGE_SIZE) == *(int*) &buffer[50]);
+
+    uint8_t result[sizeof(buffer)];
+    vms_read_range(start, result, sizeof(result));
+    assert(memcmp(buffer, result, sizeof(buffer)) == 0);
+
+    /* Writing a range in a COW child copies each touched page once */
+    void* forked_l2 = vms_fork_copy_on_write();
+    vms_set_root_page_table(forked_l2);
+    assert(vms_get_used_pages() == 10);
+    memset(result, 0xAA, sizeof(result));
+    vms_write_range(start, result, sizeof(result));
+    assert(vms_get_used_pages() == 14);
+
+    vms_set_root_page_table(l2);
+    vms_read_range(start, result, sizeof(result));
+    assert(memcmp(buffer, result, sizeof(buffer)) == 0);
+
+    /* Copy within the address space, source and destination misaligned */
+    vms_memcpy_virtual(base + 10, base + 2 * PAGE_SIZE + 3, PAGE_SIZE + 5);
+    uint8_t copied[PAGE_SIZE + 5];
+    vms_read_range(base + 10, copied, sizeof(copied));
+    assert(memcmp(copied, &buffer[PAGE_SIZE + 53], sizeof(copied)) == 0);
+    assert(vms_get_used_pages() == 14);
+
+    /* Overlapping copies across pages behave like memmove both ways */
+    vms_write_range(start, buffer, sizeof(buffer));
+    vms_memcpy_virtual(start + 100, start, PAGE_SIZE + 5);
+    vms_read_range(start + 100, copied, sizeof(copied));
+    assert(memcmp(copied, buffer, sizeof(copied)) == 0);
+    vms_write_range(start, buffer, sizeof(buffer));
+    vms_memcpy_virtual(start, start + 100, PAGE_SIZE + 5);
+    vms_read_range(start, copied, sizeof(copied));
+    assert(memcmp(copied, &buffer[100], sizeof(copied)) == 0);
+}
@@ -0,0 +1,89 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    vms_init();
+
+    void* l2 = vms_new_page();
+    void* l1 = vms_new_page();
+    void* l0 = vms_new_page();
+    void* p0 = vms_new_page();
+    void* p1 = vms_new_page();
+
+    void* virtual_address_1 = (void*) 0xABC123;
+    void* virtual_address_2 = (void*) 0xABD123;
+    uint64_t* l2_entry = vms_page_table_pte_entry(l2, virtual_address_1, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+
+    uint64_t* l1_entry = vms_page_table_pte_entry(l1, virtual_address_1, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(l0));
+    vms_pte_valid_set(l1_entry);
+
+    uint64_t* l0_entry_1 = vms_page_table_pte_entry(l0, virtual_address_1, 0);
+    vms_pte_set_ppn(l0_entry_1, vms_page_to_ppn(p0));
+    vms_pte_valid_set(l0_entry_1);
+    vms_pte_read_set(l0_entry_1);
+    vms_pte_write_set(l0_entry_1);
+
+    uint64_t* l0_entry_2 = vms_page_table_pte_entry(l0, virtual_address_2, 0);
+    vms_pte_set_ppn(l0_entry_2, vms_page_to_ppn(p1));
+    vms_pte_valid_set(l0_entry_2);
+    vms_pte_read_set(l0_entry_2);
+    vms_pte_write_set(l0_entry_2);
+
+    vms_set_root_page_table(l2);
+    vms_write(virtual_address_1, 1);
+    vms_write(virtual_address_2, 2);
+    int baseline = vms_get_used_pages();
+    assert(vms_page_ref_count(p0) == 1);
+
+    void* forked_l2 = vms_fork_copy_on_write();
+    assert(vms_get_used_pages() == baseline + 3);
+    assert(vms_page_ref_count(p0) == 2);
+    assert(vms_page_ref_count(p1) == 2);
+
+    /* The child copies, dropping its reference to the original */
+    vms_set_root_page_table(forked_l2);
+    vms_write(virtual_address_1, 3);
+    assert(vms_get_used_pages() == baseline + 4);
+    assert(vms_page_ref_count(p0) == 1);
+
+    /* The parent is the sole owner, so its write reuses the page */
+    vms_set_root_page_table(l2);
+    vms_write(virtual_address_1, 4);
+    assert(vms_get_used_pages() == baseline + 4);
+    assert(vms_read(virtual_address_1) == 4);
+
+    /* Unmapping the last reference frees the page */
+    vms_unmap(virtual_address_2);
+    assert(vms_page_ref_count(p1) == 1);
+    assert(vms_get_used_pages() == baseline + 4);
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(virtual_address_2) == 2);
+    vms_unmap(virtual_address_2);
+    vms_unmap(virtual_address_1);
+    assert(vms_get_used_pages() == baseline + 2);
+    vms_set_root_page_table(l2);
+    vms_unmap(virtual_address_1);
+    assert(vms_get_used_pages() == baseline + 1);
+    vms_unmap(virtual_address_1);
+    assert(vms_get_used_pages() == baseline + 1);
+
+    /* Shared tables are unshared before an unmap touches them */
+    void* p2 = vms_new_page();
+    vms_pte_set_ppn(l0_entry_1, vms_page_to_ppn(p2));
+    vms_pte_valid_set(l0_entry_1);
+    vms_pte_read_set(l0_entry_1);
+    vms_pte_write_set(l0_entry_1);
+    vms_write(virtual_address_1, 9);
+    void* shared_l2 = vms_fork_copy_on_write_shared();
+    vms_set_root_page_table(shared_l2);
+    vms_unmap(virtual_address_1);
+    assert(vms_page_ref_count(p2) == 1);
+    vms_set_root_page_table(l2);
+    assert(vms_read(virtual_address_1) == 9);
+}
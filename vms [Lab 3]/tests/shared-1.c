@@ -0,0 +1,71 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+static uint8_t* const shared = (uint8_t*) 0x40000000;
+static uint8_t* const private = (uint8_t*) 0x80000000;
+
+static int page(uint8_t* base, int i) {
+    return vms_read(base + i * PAGE_SIZE);
+}
+
+/* Writes through `child` reach the shared pages of `parent`, which stay
+   shared whichever side touched them first, and private pages do not */
+static void check_child(void* parent, void* child, int value) {
+    vms_set_root_page_table(child);
+    vms_write(shared, value);
+    vms_write(shared + 6 * PAGE_SIZE, value + 6); //untouched before the fork
+    vms_write(private, value);
+    vms_set_root_page_table(parent);
+    assert(page(shared, 0) == value);
+    assert(page(shared, 6) == value + 6);
+    assert(page(private, 0) == 0);
+
+    vms_write(shared + PAGE_SIZE, value + 1);
+    vms_set_root_page_table(child);
+    assert(page(shared, 1) == value + 1);
+    vms_set_root_page_table(parent);
+    vms_destroy_address_space(child);
+}
+
+void test() {
+    assert(vms_init_pool(256) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    int pages = 8;
+    assert(vms_map_range(shared, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, VMS_MAP_SHARED) == 0);
+    assert(vms_map_range(private, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    for (int i = 0; i < pages / 2; ++i) {
+        vms_write(shared + i * PAGE_SIZE, 0);
+        vms_write(private + i * PAGE_SIZE, 0);
+    }
+
+    check_child(l2, vms_fork_copy(), 10);
+    check_child(l2, vms_fork_copy_parallel(2), 20);
+    check_child(l2, vms_fork_copy_on_write(), 30);
+    check_child(l2, vms_fork_copy_on_write_shared(), 40);
+
+    /* Identical shared pages are not merged, or writes would stop being
+       seen by the other address spaces */
+    struct vms_merge_stats stats;
+    vms_write(shared + 2 * PAGE_SIZE, 40);
+    assert(vms_merge_pages(NULL, 0, &stats) == 0);
+    void* child = vms_fork_copy_on_write();
+    vms_set_root_page_table(child);
+    vms_write(shared + 2 * PAGE_SIZE, 50);
+    vms_set_root_page_table(l2);
+    assert(page(shared, 2) == 50);
+    assert(page(shared, 0) == 40);
+
+    /* The shared pages outlive the address space that touched them first */
+    vms_destroy_address_space(l2);
+    vms_set_root_page_table(child);
+    assert(page(shared, 6) == 46);
+    vms_destroy_address_space(child);
+    assert(vms_get_used_pages() == 0);
+}
@@ -0,0 +1,69 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <errno.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(256) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    uint8_t* base = (uint8_t*) 0x40000000;
+    uint8_t* extra = (uint8_t*) 0x80000000;
+    int pages = 64;
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE,
+                         VMS_MAP_POPULATE) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+    }
+    int used = vms_get_used_pages();
+
+    /* Taking a snapshot costs its root table only */
+    void* snapshot = vms_snapshot(l2);
+    assert(snapshot != NULL);
+    assert(vms_get_used_pages() == used + 1);
+
+    /* The first write unshares the tables below the root, then each
+       written page is copied once */
+    for (int i = 0; i < pages; i += 4) {
+        vms_write(base + i * PAGE_SIZE, -i);
+        vms_write(base + i * PAGE_SIZE + 4, -i);
+    }
+    int tables = vms_get_levels() - 1;
+    assert(vms_get_used_pages() == used + 1 + tables + pages / 4);
+    vms_unmap(base + PAGE_SIZE);
+    assert(vms_map_range(extra, PAGE_SIZE, VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    vms_write(extra, 7);
+
+    assert(vms_restore(snapshot) == 0);
+    assert(vms_get_root_page_table() == l2);
+    assert(vms_get_used_pages() == used + 1);
+    for (int i = 0; i < pages; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE) == i);
+        assert(vms_read(base + i * PAGE_SIZE + 4) == 0);
+    }
+    /* The mapping made after the snapshot is gone, so it can be made again */
+    assert(vms_map_range(extra, PAGE_SIZE, VMS_PROT_READ, 0) == 0);
+
+    /* The snapshot can be restored again */
+    vms_write(base, 100);
+    assert(vms_restore(snapshot) == 0);
+    assert(vms_read(base) == 0);
+
+    /* Or dropped, leaving the address space as it is */
+    vms_write(base, 200);
+    vms_destroy_address_space(snapshot);
+    assert(vms_read(base) == 200);
+    assert(vms_read(base + 2 * PAGE_SIZE) == 2);
+
+    /* A snapshot outliving its address space cannot be restored */
+    snapshot = vms_snapshot(l2);
+    vms_destroy_address_space(l2);
+    assert(vms_restore(snapshot) == EINVAL);
+    assert(vms_restore(l2) == EINVAL);
+    vms_destroy_address_space(snapshot);
+    assert(vms_get_used_pages() == 0);
+}
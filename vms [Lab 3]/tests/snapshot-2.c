@@ -0,0 +1,26 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <errno.h>
+
+int expected_exit_status() { return EFAULT; }
+
+void test() {
+    assert(vms_init_pool(64) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    uint8_t* base = (uint8_t*) 0x40000000;
+    assert(vms_map_range(base, 4 * PAGE_SIZE, VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    vms_write(base, 1);
+
+    /* A snapshot can be read like any address space */
+    void* snapshot = vms_snapshot(l2);
+    assert(snapshot != NULL);
+    vms_set_root_page_table(snapshot);
+    assert(vms_read(base) == 1);
+    assert(vms_read(base + PAGE_SIZE) == 0);
+
+    /* But writing to it would change the checkpoint, which is fatal */
+    vms_write(base, 99);
+}
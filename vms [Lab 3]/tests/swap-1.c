@@ -0,0 +1,74 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(32) == 0);
+    assert(vms_swap_enable("vms-swap-1.swap", 1024) == 0);
+    unlink("vms-swap-1.swap"); //the open descriptor keeps it alive
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+
+    /* Eight times more data than the pool can hold */
+    uint8_t* base = (uint8_t*) 0x40000000;
+    int pages = 256;
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+        vms_write(base + i * PAGE_SIZE + 8, -i);
+    }
+    assert(vms_get_used_pages() == 32);
+
+    struct vms_swap_stats stats;
+    vms_swap_get_stats(&stats);
+    assert(stats.evictions >= (uint64_t) pages - 32);
+    assert(stats.swap_writes == stats.evictions);
+
+    for (int i = 0; i < pages; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE) == i);
+        assert(vms_read(base + i * PAGE_SIZE + 8) == -i);
+    }
+    vms_swap_get_stats(&stats);
+    assert(stats.major_faults > 0);
+    assert(stats.swap_reads == stats.major_faults);
+
+    /* Copy across pages that keep evicting each other */
+    vms_memcpy_virtual(base + 100 * PAGE_SIZE, base + 200 * PAGE_SIZE,
+                       4 * PAGE_SIZE);
+    assert(vms_read(base + 103 * PAGE_SIZE) == 203);
+
+    /* Pages shared with another address space are never evicted, so free
+       some room for the child to copy into */
+    for (int i = 200; i < pages; ++i) {
+        vms_unmap(base + i * PAGE_SIZE);
+    }
+
+    /* A child shares the swapped pages, and both sides see their own data */
+    void* forked_l2 = vms_fork_copy_on_write();
+    assert(forked_l2 != NULL);
+    vms_set_root_page_table(forked_l2);
+    for (int i = 0; i < 200; i += 5) {
+        vms_write(base + i * PAGE_SIZE, 1000 + i);
+    }
+    vms_set_root_page_table(l2);
+    for (int i = 0; i < 200; i += 5) {
+        int expected = i >= 100 && i < 104 ? i + 100 : i;
+        assert(vms_read(base + i * PAGE_SIZE) == expected);
+    }
+    vms_set_root_page_table(forked_l2);
+    for (int i = 0; i < 200; i += 5) {
+        assert(vms_read(base + i * PAGE_SIZE) == 1000 + i);
+    }
+
+    vms_unmap(base);
+    vms_destroy_address_space(forked_l2);
+    vms_set_root_page_table(l2);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+    assert(vms_swap_disable() == 0);
+}
@@ -0,0 +1,55 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <unistd.h>
+
+int expected_exit_status() { return 0; }
+
+static uint8_t* const base = (uint8_t*) 0x40000000;
+
+/* Touch every other page until the first one has been evicted */
+static void evict_first(int pages) {
+    for (int round = 0; round < 4; ++round) {
+        for (int i = 1; i < pages; ++i) {
+            vms_read(base + i * PAGE_SIZE);
+        }
+    }
+}
+
+void test() {
+    assert(vms_init_pool(16) == 0);
+    assert(vms_swap_enable("vms-swap-2.swap", 256) == 0);
+    unlink("vms-swap-2.swap"); //the open descriptor keeps it alive
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    int pages = 64;
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, 1);
+    }
+    evict_first(pages);
+
+    /* Swapped in, the page keeps its slot as a clean copy until written */
+    assert(vms_read(base) == 1);
+    vms_write(base, 2);
+
+    /* The child's entry must not trust the stale copy once the parent,
+       which dirtied the page, is gone */
+    void* forked_l2 = vms_fork_copy_on_write();
+    assert(forked_l2 != NULL);
+    vms_set_root_page_table(forked_l2);
+    vms_destroy_address_space(l2);
+    evict_first(pages);
+
+    struct vms_swap_stats stats;
+    vms_swap_reset_stats();
+    assert(vms_read(base) == 2);
+    vms_swap_get_stats(&stats);
+    assert(stats.major_faults == 1);
+
+    vms_destroy_address_space(forked_l2);
+    assert(vms_get_used_pages() == 0);
+    assert(vms_swap_disable() == 0);
+}
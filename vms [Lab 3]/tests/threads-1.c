@@ -0,0 +1,77 @@
+#include "vms.h"
+
+#include <assert.h>
+#include <pthread.h>
+
+#define THREADS 4
+#define PAGES 256
+#define ROUNDS 20
+
+int expected_exit_status() { return 0; }
+
+static uint8_t* const base = (uint8_t*) 0x40000000;
+static uint8_t* const zeroed = (uint8_t*) 0x40000000 + PAGES * PAGE_SIZE;
+static void* shared_l2;
+
+/* Every thread writes its own slot of every copy-on-write page, so each
+   page takes concurrent COW faults, and reads pages another thread may be
+   populating on demand */
+static void* worker(void* argument) {
+    int thread = (int) (intptr_t) argument;
+    vms_set_root_page_table(shared_l2);
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int i = 0; i < PAGES; ++i) {
+            int* slot = (int*) (base + i * PAGE_SIZE) + 1 + thread;
+            vms_write(slot, thread * 1000 + round);
+            assert(vms_read(slot) == thread * 1000 + round);
+            assert(vms_read(base + i * PAGE_SIZE) == i);
+            assert(vms_read(zeroed + i * PAGE_SIZE + 4 * thread) == 0);
+        }
+    }
+    return NULL;
+}
+
+void test() {
+    assert(vms_init_pool(1024) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    assert(vms_map_range(base, 2 * PAGES * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    for (int i = 0; i < PAGES; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+    }
+    /* The root, the tables below it and the data pages */
+    int levels = vms_get_levels();
+    int used = vms_get_used_pages();
+    assert(used == levels + PAGES);
+
+    shared_l2 = vms_fork_copy_on_write();
+    assert(vms_get_used_pages() == used + levels);
+
+    pthread_t threads[THREADS];
+    for (int t = 0; t < THREADS; ++t) {
+        assert(pthread_create(&threads[t], NULL, worker, (void*) (intptr_t) t) == 0);
+    }
+    for (int t = 0; t < THREADS; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+
+    /* Each page was copied and each zero page allocated exactly once */
+    assert(vms_get_used_pages() == used + levels + 2 * PAGES);
+    vms_set_root_page_table(shared_l2);
+    for (int i = 0; i < PAGES; ++i) {
+        int* page = (int*) (base + i * PAGE_SIZE);
+        for (int t = 0; t < THREADS; ++t) {
+            assert(vms_read(page + 1 + t) == t * 1000 + ROUNDS - 1);
+        }
+    }
+
+    vms_set_root_page_table(l2);
+    for (int i = 0; i < PAGES; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE + 4) == 0);
+    }
+    vms_destroy_address_space(shared_l2);
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+}
@@ -0,0 +1,71 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    vms_init();
+
+    void* l2 = vms_new_page();
+    void* l1 = vms_new_page();
+    void* l0 = vms_new_page();
+    void* p0 = vms_new_page();
+
+    void* virtual_address = (void*) 0xABC123;
+    uint64_t* l2_entry = vms_page_table_pte_entry(l2, virtual_address, 2);
+    vms_pte_set_ppn(l2_entry, vms_page_to_ppn(l1));
+    vms_pte_valid_set(l2_entry);
+
+    uint64_t* l1_entry = vms_page_table_pte_entry(l1, virtual_address, 1);
+    vms_pte_set_ppn(l1_entry, vms_page_to_ppn(l0));
+    vms_pte_valid_set(l1_entry);
+
+    uint64_t* l0_entry = vms_page_table_pte_entry(l0, virtual_address, 0);
+    vms_pte_set_ppn(l0_entry, vms_page_to_ppn(p0));
+    vms_pte_valid_set(l0_entry);
+    vms_pte_read_set(l0_entry);
+    vms_pte_write_set(l0_entry);
+
+    vms_set_root_page_table(l2);
+    vms_tlb_reset_stats();
+
+    struct vms_tlb_stats stats;
+    vms_write(virtual_address, 1);
+    for (int i = 0; i < 10; ++i) {
+        assert(vms_read(virtual_address) == 1);
+    }
+    vms_tlb_get_stats(&stats);
+    assert(stats.misses == 1);
+    assert(stats.hits == 10);
+
+    /* The child has its own root, so it must not hit the parent's entry */
+    void* forked_l2 = vms_fork_copy_on_write();
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(virtual_address) == 1);
+    vms_write(virtual_address, 2);
+    assert(vms_read(virtual_address) == 2);
+
+    vms_set_root_page_table(l2);
+    assert(vms_read(virtual_address) == 1);
+    vms_write(virtual_address, 3);
+    assert(vms_read(virtual_address) == 3);
+
+    vms_set_root_page_table(forked_l2);
+    assert(vms_read(virtual_address) == 2);
+
+    /* Permission changes made in place are seen without a flush */
+    vms_set_root_page_table(l2);
+    vms_pte_write_clear(l0_entry);
+    assert(vms_read(virtual_address) == 3);
+    vms_pte_read_clear(l0_entry);
+    vms_pte_valid_clear(l0_entry);
+    vms_tlb_get_stats(&stats);
+    uint64_t misses = stats.misses;
+    vms_tlb_flush();
+    vms_pte_valid_set(l0_entry);
+    vms_pte_read_set(l0_entry);
+    assert(vms_read(virtual_address) == 3);
+    vms_tlb_get_stats(&stats);
+    assert(stats.misses == misses + 1);
+}
@@ -0,0 +1,60 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+void test() {
+    assert(vms_init_pool(2048) == 0);
+    assert(vms_profile_enable(VMS_PROFILE_COUNTERS, 0) == 0);
+
+    void* l2 = vms_new_page();
+    vms_set_root_page_table(l2);
+    /* Two 2 MiB regions, more pages than the TLB holds */
+    uint8_t* base = (uint8_t*) 0x40000000;
+    int pages = 2 * 512;
+    assert(vms_map_range(base, pages * PAGE_SIZE,
+                         VMS_PROT_READ | VMS_PROT_WRITE,
+                         VMS_MAP_POPULATE) == 0);
+    for (int i = 0; i < pages; ++i) {
+        vms_write(base + i * PAGE_SIZE, i);
+    }
+
+    vms_tlb_flush();
+    vms_tlb_reset_stats();
+    vms_reset_counters(l2);
+    for (int i = 0; i < pages; ++i) {
+        assert(vms_read(base + i * PAGE_SIZE) == i);
+    }
+    struct vms_tlb_stats stats;
+    vms_tlb_get_stats(&stats);
+    assert(stats.misses == (uint64_t) pages);
+    /* One full walk per region, the other pages only read their leaf */
+    assert(stats.walk_cache_misses == 2);
+    assert(stats.walk_cache_hits == (uint64_t) pages - 2);
+    struct vms_counters counters;
+    assert(vms_get_counters(l2, &counters) == 0);
+    assert(counters.walks[0] == (uint64_t) pages);
+    assert(counters.walks[1] == 2);
+    assert(counters.walks[2] == 2);
+
+    /* Sharing the tables makes cached paths stale: writes must still
+       break copy-on-write instead of writing into the shared tables */
+    void* forked_l2 = vms_fork_copy_on_write_shared();
+    for (int i = 0; i < pages; i += 7) {
+        vms_write(base + i * PAGE_SIZE, -i);
+    }
+    vms_set_root_page_table(forked_l2);
+    for (int i = 0; i < pages; i += 7) {
+        assert(vms_read(base + i * PAGE_SIZE) == i);
+    }
+
+    vms_destroy_address_space(forked_l2);
+    vms_set_root_page_table(l2);
+    for (int i = 0; i < pages; i += 7) {
+        assert(vms_read(base + i * PAGE_SIZE) == -i);
+    }
+    vms_destroy_address_space(l2);
+    assert(vms_get_used_pages() == 0);
+    vms_profile_disable();
+}
@@ -0,0 +1,45 @@
+#include "vms.h"
+
+#include <assert.h>
+
+int expected_exit_status() { return 0; }
+
+/* The entry at `level` on the path to `virtual_address` */
+static uint64_t* entry_at(void* root, void* virtual_address, int level) {
+    void* page_table = root;
+    for (int l = vms_get_levels() - 1; l > level; --l) {
+        uint64_t* entry = vms_page_table_pte_entry(page_table, virtual_address, l);
+        page_table = vms_ppn_to_page(vms_pte_get_ppn(entry));
+    }
+    return vms_page_table_pte_entry(page_table, virtual_address, level);
+}
+
+void test() {
+    assert(vms_init_pool(64) == 0);
+
+    void* root = vms_new_page();
+    vms_set_root_page_table(root);
+    uint8_t* a = (uint8_t*) 0x40000000;
+    uint8_t* b = a + HUGE_PAGE_SIZE; //another level 0 table
+    assert(vms_map_range(a, 2 * HUGE_PAGE_SIZE, VMS_PROT_READ | VMS_PROT_WRITE, 0) == 0);
+    vms_write(a, 1);
+    vms_write(b, 2);
+
+    /* Repointing a level 1 entry drops what the TLB and walk cache keep
+       for the range below it */
+    assert(vms_read(a) == 1);
+    assert(vms_read(a + 8) == 0);
+    uint64_t* entry_a = entry_at(root, a, 1);
+    uint64_t l0_a = vms_pte_get_ppn(entry_a);
+    vms_pte_set_ppn(entry_a, vms_pte_get_ppn(entry_at(root, b, 1)));
+    assert(vms_read(a) == 2);
+    vms_pte_set_ppn(entry_a, l0_a);
+    assert(vms_read(a) == 1);
+
+    /* So does clearing a valid bit above it: the range faults again, and
+       demand paging maps fresh zeroed tables and pages */
+    vms_pte_valid_clear(entry_at(root, a, vms_get_levels() - 1));
+    assert(vms_read(a) == 0);
+    assert(vms_read(b) == 0);
+    vms_destroy_address_space(root); //the tables cut off above are leaked
+}
@@ -0,0 +1,274 @@
+#include "vms.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Replays a memory access trace against vms as fast as possible. The
+   trace is text, one event per line, numbers in decimal or 0x hex:
+
+     R <pid> <address>      read the int at address
+     W <pid> <address>      write an int to address
+     F <parent> <child>     fork parent, copy-on-write unless -e is given
+     X <pid>                the process exits
+
+   Blank lines and lines starting with # are skipped. A process seen for
+   the first time without a fork gets an empty address space in which all
+   of the virtual address range is mapped read/write and demand-zero. */
+
+#define MAX_PROCESSES 4096
+
+struct process {
+    uint64_t pid;
+    void* root_page_table;
+};
+
+static struct process processes[MAX_PROCESSES];
+static int process_count = 0;
+static struct process* current = NULL;
+static int eager_fork = 0;
+/* End of the virtual address range the page tables translate */
+static uint64_t address_limit = 0;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(uint64_t line, const char* message) {
+    fprintf(stderr, "line %lu: %s\n", line, message);
+    exit(1);
+}
+
+static struct process* find(uint64_t pid) {
+    if (current != NULL && current->pid == pid) {
+        return current;
+    }
+    for (int i = 0; i < process_count; ++i) {
+        if (processes[i].pid == pid) {
+            return &processes[i];
+        }
+    }
+    return NULL;
+}
+
+static struct process* add(uint64_t line, uint64_t pid, void* root_page_table) {
+    if (process_count == MAX_PROCESSES) {
+        fail(line, "too many processes");
+    }
+    if (root_page_table == NULL) {
+        fail(line, "out of memory");
+    }
+    struct process* process = &processes[process_count++];
+    process->pid = pid;
+    process->root_page_table = root_page_table;
+    return process;
+}
+
+static void switch_to(struct process* process) {
+    if (process != current) {
+        vms_set_root_page_table(process->root_page_table);
+        current = process;
+    }
+}
+
+/* The process `pid`, created with a fresh address space if needed */
+static struct process* process_for(uint64_t line, uint64_t pid) {
+    struct process* process = find(pid);
+    if (process != NULL) {
+        return process;
+    }
+    process = add(line, pid, vms_new_page());
+    switch_to(process);
+    if (vms_map_range(NULL, address_limit, VMS_PROT_READ | VMS_PROT_WRITE, 0) != 0) {
+        fail(line, "cannot map the address space");
+    }
+    return process;
+}
+
+static void remove_process(struct process* process) {
+    if (current == process) {
+        current = NULL;
+    }
+    vms_destroy_address_space(process->root_page_table);
+    *process = processes[--process_count];
+    if (current == &processes[process_count]) {
+        current = process;
+    }
+}
+
+static const char* skip_spaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        ++p;
+    }
+    return p;
+}
+
+static const char* parse_number(uint64_t line,
+                                const char* p,
+                                const char* end,
+                                uint64_t* value) {
+    p = skip_spaces(p, end);
+    int base = 10;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    }
+    const char* start = p;
+    uint64_t result = 0;
+    for (; p < end; ++p) {
+        int digit;
+        if (*p >= '0' && *p <= '9') digit = *p - '0';
+        else if (base == 16 && *p >= 'a' && *p <= 'f') digit = *p - 'a' + 10;
+        else if (base == 16 && *p >= 'A' && *p <= 'F') digit = *p - 'A' + 10;
+        else break;
+        result = result * base + digit;
+    }
+    if (p == start) {
+        fail(line, "expected a number");
+    }
+    *value = result;
+    return p;
+}
+
+int main(int argc, char** argv) {
+    size_t pool_pages = (size_t) 1 << 20;
+    int option;
+    while ((option = getopt(argc, argv, "ep:")) != -1) {
+        if (option == 'e') {
+            eager_fork = 1;
+        }
+        else if (option == 'p') {
+            pool_pages = strtoull(optarg, NULL, 0);
+        }
+        else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-e] [-p POOL_PAGES] TRACE\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+    const char* trace = "";
+    if (st.st_size > 0) {
+        trace = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (trace == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        madvise((void*) trace, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    int err = vms_init_pool(pool_pages);
+    if (err != 0) {
+        fprintf(stderr, "vms_init_pool: %s\n", strerror(err));
+        return 1;
+    }
+
+    address_limit = (uint64_t) 1 << (12 + 9 * vms_get_levels());
+    uint64_t accesses = 0;
+    uint64_t forks = 0;
+    int peak_pages = 0;
+    long sum = 0;
+    const char* end = trace + st.st_size;
+    uint64_t line = 0;
+    double start = now();
+    for (const char* p = trace; p < end; ) {
+        ++line;
+        const char* eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char* q = skip_spaces(p, eol);
+        char kind = q < eol ? *q++ : '#';
+        uint64_t pid;
+        uint64_t argument;
+        switch (kind) {
+        case '#':
+        case '\r':
+            break;
+        case 'R':
+        case 'W':
+            q = parse_number(line, q, eol, &pid);
+            parse_number(line, q, eol, &argument);
+            if (argument >= address_limit - sizeof(int)) {
+                fail(line, "address out of range");
+            }
+            switch_to(process_for(line, pid));
+            if (kind == 'R') {
+                sum += vms_read((void*) argument);
+            }
+            else {
+                vms_write((void*) argument, (int) accesses);
+            }
+            ++accesses;
+            break;
+        case 'F': {
+            q = parse_number(line, q, eol, &pid);
+            parse_number(line, q, eol, &argument);
+            if (find(argument) != NULL) {
+                fail(line, "the child already exists");
+            }
+            switch_to(process_for(line, pid));
+            add(line, argument, eager_fork ? vms_fork_copy() : vms_fork_copy_on_write());
+            ++forks;
+            break;
+        }
+        case 'X': {
+            parse_number(line, q, eol, &pid);
+            struct process* process = find(pid);
+            if (process == NULL) {
+                fail(line, "no such process");
+            }
+            remove_process(process);
+            break;
+        }
+        default:
+            fail(line, "unknown event");
+        }
+        int used = vms_get_used_pages();
+        if (used > peak_pages) {
+            peak_pages = used;
+        }
+        p = eol + 1;
+    }
+    double seconds = now() - start;
+
+    struct vms_swap_stats swap;
+    struct vms_tlb_stats tlb;
+    vms_swap_get_stats(&swap);
+    vms_tlb_get_stats(&tlb);
+    printf("%-16s %12lu\n", "accesses", accesses);
+    printf("%-16s %12lu\n", "forks", forks);
+    printf("%-16s %12.3f s\n", "time", seconds);
+    printf("%-16s %12.1f M/s\n", "access rate", accesses / seconds / 1e6);
+    printf("%-16s %12lu\n", "page faults", swap.faults);
+    printf("%-16s %12.2f %%\n", "tlb misses",
+           tlb.hits + tlb.misses == 0 ? 0 : 100.0 * tlb.misses / (tlb.hits + tlb.misses));
+    uint64_t walks = tlb.walk_cache_hits + tlb.walk_cache_misses;
+    printf("%-16s %12.2f %%\n", "walk cache hits",
+           walks == 0 ? 0 : 100.0 * tlb.walk_cache_hits / walks);
+    printf("%-16s %12d\n", "pages in use", vms_get_used_pages());
+    printf("%-16s %12d\n", "peak pages", peak_pages);
+
+    while (process_count > 0) {
+        remove_process(&processes[process_count - 1]);
+    }
+    return sum == -1; //keep the reads
+}
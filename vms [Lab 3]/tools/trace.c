@@ -0,0 +1,170 @@
+#include "vms.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Summarizes a trace written by vms_trace_dump, overall and per address
+   space, e.g. to compare the cost of eager and copy-on-write forks */
+
+#define MAX_SPACES 64
+
+static const char* event_names[VMS_EVENT_TYPES] = {
+    "translation", "walk", "fault", "cow_fault", "copy", "alloc", "free", "fork",
+};
+
+static const char* fault_reason_names[VMS_FAULT_REASONS] = {
+    "not present", "swapped", "shared table", "copy-on-write", "protection",
+};
+
+struct summary {
+    uint64_t space;
+    uint64_t events[VMS_EVENT_TYPES];
+    uint64_t walks[VMS_PROFILE_LEVELS]; //by leaf level
+    uint64_t faults[VMS_PROFILE_LEVELS];
+    uint64_t fault_reasons[VMS_FAULT_REASONS];
+    uint64_t copied_bytes;
+    uint64_t pages_allocated;
+    uint64_t pages_freed;
+    uint64_t fork_nanoseconds;
+    uint64_t slowest_fork;
+};
+
+static struct summary spaces[MAX_SPACES];
+static int space_count = 0;
+static int spaces_dropped = 0;
+
+static struct summary* summary_for(uint64_t space) {
+    for (int i = 0; i < space_count; ++i) {
+        if (spaces[i].space == space) {
+            return &spaces[i];
+        }
+    }
+    if (space_count == MAX_SPACES) {
+        spaces_dropped = 1;
+        return NULL;
+    }
+    spaces[space_count].space = space;
+    return &spaces[space_count++];
+}
+
+static void add(struct summary* summary, const struct vms_event* event) {
+    int level = event->level;
+    if (level < 0 || level >= VMS_PROFILE_LEVELS) {
+        level = 0;
+    }
+    ++summary->events[event->type];
+    switch (event->type) {
+    case VMS_EVENT_WALK:
+        ++summary->walks[level];
+        break;
+    case VMS_EVENT_FAULT:
+        ++summary->faults[level];
+        if (event->value < VMS_FAULT_REASONS) {
+            ++summary->fault_reasons[event->value];
+        }
+        break;
+    case VMS_EVENT_COPY:
+        summary->copied_bytes += event->value;
+        break;
+    case VMS_EVENT_ALLOC:
+        summary->pages_allocated += event->value;
+        break;
+    case VMS_EVENT_FREE:
+        summary->pages_freed += event->value;
+        break;
+    case VMS_EVENT_FORK:
+        summary->fork_nanoseconds += event->value;
+        if (event->value > summary->slowest_fork) {
+            summary->slowest_fork = event->value;
+        }
+        break;
+    }
+}
+
+static void print_levels(const char* name, const uint64_t* counts, int levels) {
+    printf("  %-14s", name);
+    for (int level = levels - 1; level >= 0; --level) {
+        printf(" L%d %-10lu", level, counts[level]);
+    }
+    printf("\n");
+}
+
+static void print_summary(const struct summary* summary, int levels) {
+    for (int type = 0; type < VMS_EVENT_TYPES; ++type) {
+        printf("  %-14s %12lu\n", event_names[type], summary->events[type]);
+    }
+    print_levels("walk leaves", summary->walks, levels);
+    print_levels("faults", summary->faults, levels);
+    for (int reason = 0; reason < VMS_FAULT_REASONS; ++reason) {
+        if (summary->fault_reasons[reason] != 0) {
+            printf("    %-12s %12lu\n", fault_reason_names[reason], summary->fault_reasons[reason]);
+        }
+    }
+    printf("  %-14s %12lu\n", "copied KiB", summary->copied_bytes / 1024);
+    printf("  %-14s %12lu\n", "pages net", summary->pages_allocated - summary->pages_freed);
+    if (summary->events[VMS_EVENT_FORK] != 0) {
+        printf("  %-14s %12.3f ms mean, %.3f ms max\n", "fork time",
+               summary->fork_nanoseconds / 1e6 / summary->events[VMS_EVENT_FORK],
+               summary->slowest_fork / 1e6);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+        return 2;
+    }
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    struct vms_trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, VMS_TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != 1
+        || header.levels > VMS_PROFILE_LEVELS) {
+        fprintf(stderr, "%s: not a vms trace\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    struct summary total = {0};
+    uint64_t first = 0;
+    uint64_t last = 0;
+    struct vms_event event;
+    uint64_t read = 0;
+    while (read < header.events && fread(&event, sizeof(event), 1, file) == 1) {
+        if (event.type >= VMS_EVENT_TYPES) {
+            continue;
+        }
+        if (read++ == 0) {
+            first = event.time;
+        }
+        last = event.time;
+        add(&total, &event);
+        struct summary* summary = summary_for(event.space);
+        if (summary != NULL) {
+            add(summary, &event);
+        }
+    }
+    fclose(file);
+
+    printf("%lu events over %.3f ms", read, (last - first) / 1e6);
+    if (header.dropped != 0) {
+        printf(", %lu older ones dropped", header.dropped);
+    }
+    printf("\n\nall address spaces\n");
+    print_summary(&total, header.levels);
+    for (int i = 0; i < space_count; ++i) {
+        printf("\naddress space 0x%lX\n", spaces[i].space);
+        print_summary(&spaces[i], header.levels);
+    }
+    if (spaces_dropped) {
+        printf("\nmore than %d address spaces, the rest are only in the total\n",
+               MAX_SPACES);
+    }
+    return 0;
+}